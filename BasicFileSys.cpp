@@ -2,20 +2,77 @@
 // Implements low-level file system functionality that interfaces with
 // the disk.
 
+#include <algorithm>  // any_of, min
+#include <cstring>  // memcpy, memset
+#include <fstream>  // ifstream, ofstream
+#include <string>  // string
+#include <vector>  // vector
+
 #include "Disk.h"
 #include "Blocks.h"
 #include "BasicFileSys.h"
+#include "Journal.h"
+
+// Added to the disk file's name to name the file listing the hottest cached
+// blocks at the last unmount, one block number per line
+static const char WARM_LIST_SUFFIX[] = ".warm";
+
+// Added to the disk file's name to name the file the blocks of a committing
+// transaction are logged to
+static const char JOURNAL_SUFFIX[] = ".journal";
+
+// Returns the first inode table block of the block group.
+static int inode_table_start(int group)
+{
+	return group * BLOCKS_PER_GROUP + (group == 0 ? 2 : 0);
+}
 
 // Mounts the simulated disk file. If a disk file is created, this
 // routines also "formats" the disk by initializing special blocks
-// 0 (superblock) and 1 (root directory).
-void BasicFileSys::mount()
+// 0 (superblock) and 1 (root directory) and the inode tables. A read-only
+// mount maps the existing disk file instead, and leaves the journal alone.
+void BasicFileSys::mount(const MountOptions &options)
 {
+	reserved_count = 0;
+	next_fit_mode = options.next_fit;
+	next_fit_pos = 0;
+	deferred_mode = options.deferred_free;
+	read_only_mode = options.read_only;
+	disk_file = options.disk_file;
+	orphans.clear();
+	orphan_blocks = 0;
+	free_count = 0;
+
+	// blocks are read straight from the mapping and nothing is allocated,
+	// so there is no cache to set up, no journal to replay and no free
+	// block or inode map to build
+	if (read_only_mode) {
+		disk.mount_read_only(disk_file.c_str());
+		return;
+	}
+
+	cache.mount(&disk, options.cache_blocks, options.cache_min_blocks, options.cache_max_blocks, options.huge_pages);
+
 	// mount the disk
-	bool new_disk = disk.mount("DISK");
+	bool new_disk = disk.mount(disk_file.c_str(), options.direct_io);
+	journal.mount((disk_file + JOURNAL_SUFFIX).c_str(), &disk, new_disk);
 
-	// if the disk exists, return as no further initialization is needed
-	if (!new_disk) return;
+	// if the disk exists, count its free blocks and inodes as no further
+	// initialization is needed
+	if (!new_disk) {
+		load_maps();
+
+		// queue the blocks that were hot before the last unmount
+		std::ifstream warm(disk_file + WARM_LIST_SUFFIX);
+		std::vector<int> blocks;
+		int block_num;
+		while (warm >> block_num) {
+			blocks.push_back(block_num);
+		}
+		cache.prefetch(blocks);
+		return;
+	}
+	free_count = NUM_BLOCKS - 2 - NUM_GROUPS * INODE_BLOCKS_PER_GROUP;
 
 	// initialize the superblock
 	struct superblock_t super_block;
@@ -23,14 +80,22 @@ void BasicFileSys::mount()
 	for (int i = 1; i < BLOCK_SIZE; i++) {
 		super_block.bitmap[i] = 0;
 	}
+	for (int group = 0; group < NUM_GROUPS; group++) {	// and the inode tables
+		for (int i = 0; i < INODE_BLOCKS_PER_GROUP; i++) {
+			int block = inode_table_start(group) + i;
+			super_block.bitmap[block / 8] |= 1 << (block % 8);
+		}
+	}
 	disk.write_block(0, (void *)&super_block);
+	free_map.load(super_block.bitmap, NUM_BLOCKS, BLOCKS_PER_GROUP);
 
 	// initialize the root directory
 	struct dirblock_t dir_block;
 	dir_block.magic = DIR_MAGIC_NUM;
 	dir_block.num_entries = 0;
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-		dir_block.dir_entries[i].block_num = 0;
+	dir_block.length = 0;
+	for (int i = 0; i < MAX_DIR_BLOCKS; i++) {
+		dir_block.blocks[i] = 0;
 	}
 	disk.write_block(1, (void *)&dir_block);
 
@@ -39,44 +104,327 @@ void BasicFileSys::mount()
 	for (int i = 0; i < BLOCK_SIZE; i++) {
 		data_block.data[i] = 0;
 	}
+	struct inodeblock_t inode_block;
+	std::memset(&inode_block, 0, sizeof(inode_block));
+	inode_block.magic = INODE_MAGIC_NUM;
+	std::vector<BlockWrite> writes(NUM_BLOCKS - 2);
 	for (int i = 2; i < NUM_BLOCKS; i++) {
-		disk.write_block(i, (void *)&data_block);
+		int offset = i - inode_table_start(i / BLOCKS_PER_GROUP);
+		bool in_table = offset >= 0 && offset < INODE_BLOCKS_PER_GROUP;
+		writes[i - 2].block_num = i;
+		writes[i - 2].block = in_table ? (void *)&inode_block : (void *)&data_block;
 	}
+	disk.write_blocks(writes);
+
+	// every inode starts out free
+	std::vector<unsigned char> inode_bitmap((NUM_INODES + 7) / 8, 0);
+	inode_map.load(inode_bitmap.data(), NUM_INODES, INODES_PER_GROUP);
 }
 
-// Unmounts the disk
+// Unmounts the disk, recording the hottest cached blocks so the next mount
+// can read them back in.
 void BasicFileSys::unmount()
 {
+	if (read_only_mode) {
+		disk.unmount();
+		return;
+	}
+
+	journal.unmount();
+
+	std::ofstream warm(disk_file + WARM_LIST_SUFFIX, std::ios::trunc);
+	for (int block_num : cache.hot_blocks(WARM_LIST_BLOCKS)) {
+		warm << block_num << '\n';
+	}
+	warm.close();
+
+	cache.unmount();
+	disk.sync();
 	disk.unmount();
 }
 
-// Gets a free block from the disk.
-short BasicFileSys::get_free_block()
+// Gets a free block from the disk, the first one after a_goal in its block
+// group if there is one, else the first one in the group, else the first
+// one in the groups after it. In next-fit mode the goal is ignored and the
+// block is the first free one at or after where the last allocation ended.
+short BasicFileSys::get_free_block(short a_goal)
 {
-	// get superblock
+	// leave promised blocks to their owners, after reclaiming removed files
+	// if that makes room
+	if (free_count - reserved_count <= 0 && !orphans.empty()) reclaim_orphans(NUM_BLOCKS);
+	if (free_count - reserved_count <= 0) return 0;
+
+	// look up an available block near the goal, or after the last one
+	// allocated, in the free map
+	if (a_goal < 0 || a_goal >= NUM_BLOCKS) a_goal = 0;
+	int block;
+	if (next_fit_mode) {
+		block = free_map.find_free(next_fit_pos, NUM_BLOCKS);
+		if (block < 0) block = free_map.find_free(0, next_fit_pos);
+	} else {
+		int first = a_goal - a_goal % BLOCKS_PER_GROUP;
+		int end = std::min(first + BLOCKS_PER_GROUP, NUM_BLOCKS);
+		block = free_map.find_free(a_goal, end);
+		if (block < 0) block = free_map.find_free(first, a_goal);
+		if (block < 0) block = free_map.find_free(end, NUM_BLOCKS);
+		if (block < 0) block = free_map.find_free(0, first);
+	}
+	if (block < 0) {
+		// disk is full
+		return 0;
+	}
+	if (next_fit_mode) next_fit_pos = block + 1;
+
+	// Available block is found: set bit in bitmap, write result back to
+	// superblock, and return block number.
+	struct superblock_t super_block;
+	read_block(0, (void *)&super_block);
+	super_block.bitmap[block / 8] |= 1 << (block % 8);
+	write_block(0, (void *)&super_block);
+	free_map.mark_used(block);
+	free_count--;
+	return block;
+}
+
+// Gets a run of a_count contiguous free blocks from the disk, taken from the
+// front of the shortest free run in a_goal's block group that is long
+// enough, or else the shortest one on the disk. In next-fit mode it is the
+// first long enough run at or after where the last allocation ended instead.
+// Returns the first block of the run, or 0 if no run of that length is
+// available.
+short BasicFileSys::get_free_extent(int a_count, short a_goal)
+{
+	if (a_count > free_count - reserved_count && !orphans.empty()) reclaim_orphans(NUM_BLOCKS);
+	if (a_count <= 0 || a_count > free_count - reserved_count) return 0;
+
+	// look up the best fitting run of free blocks in the free map, from the
+	// goal on in its group, then anywhere in its group, then anywhere; or
+	// the next one after the last allocation
+	if (a_goal < 0 || a_goal >= NUM_BLOCKS) a_goal = 0;
+	int start;
+	if (next_fit_mode) {
+		start = free_map.find_first_run(a_count, next_fit_pos, NUM_BLOCKS);
+		if (start < 0) start = free_map.find_first_run(a_count, 0, next_fit_pos);
+	} else {
+		int first = a_goal - a_goal % BLOCKS_PER_GROUP;
+		start = free_map.find_run(a_count, a_goal, first + BLOCKS_PER_GROUP);
+		if (start < 0) start = free_map.find_run(a_count, first, first + BLOCKS_PER_GROUP);
+		if (start < 0) start = free_map.find_run(a_count);
+	}
+	if (start < 0) {
+		// no run is long enough
+		return 0;
+	}
+	if (next_fit_mode) next_fit_pos = start + a_count;
+
+	// Run is found: set bits in bitmap, write result back to superblock,
+	// and return first block number.
 	struct superblock_t super_block;
-	disk.read_block(0, (void *)&super_block);
-
-	// look for first available block
-	for (int byte = 0; byte < BLOCK_SIZE; byte++) {
-		// check to see if byte has available slot
-		if (super_block.bitmap[byte] != 0xFF) {
-			// loop to check each bit
-			for (int bit = 0; bit < 8; bit++) {
-				int mask = 1 << bit;
-				if (mask & ~super_block.bitmap[byte]) {
-					// Available block is found: set bit in bitmap, write result back
-				// to superblock, and return block number.
-					super_block.bitmap[byte] |= mask;
-					disk.write_block(0, (void *)&super_block);
-					return (byte * 8) + bit;
+	read_block(0, (void *)&super_block);
+	for (int i = start; i < start + a_count; i++) {
+		super_block.bitmap[i / 8] |= 1 << (i % 8);
+		free_map.mark_used(i);
+	}
+	write_block(0, (void *)&super_block);
+	free_count -= a_count;
+	return start;
+}
+
+// Gets a free inode, in a_goal's block group if it has one, else in the
+// groups after it. Returns the inode number, or -1 if every inode is used.
+int BasicFileSys::get_free_inode(short a_goal)
+{
+	if (a_goal < 0 || a_goal >= NUM_BLOCKS) a_goal = 0;
+	int first = a_goal / BLOCKS_PER_GROUP * INODES_PER_GROUP;
+	int inode_num = free_inode_after(first);
+	if (inode_num < 0 && !orphans.empty()) {
+		reclaim_orphans(NUM_BLOCKS);
+		inode_num = free_inode_after(first);
+	}
+	if (inode_num < 0) return -1;
+
+	// claim the table entry, carrying on its generation count so a new
+	// file never looks like the last one that had the inode
+	struct inode_t inode;
+	read_inode(inode_num, inode);
+	unsigned int generation = inode.generation;
+	std::memset(&inode, 0, sizeof(inode));
+	inode.generation = generation;
+	write_inode(inode_num, inode);
+	inode_map.mark_used(inode_num);
+	return inode_num;
+}
+
+// Frees the inode for reuse. Its data blocks and block map are not
+// reclaimed, and its generation is kept for the next file to carry on.
+void BasicFileSys::reclaim_inode(int inode_num)
+{
+	struct inodeblock_t table;
+	short block_num = get_inode_block(inode_num);
+	read_block(block_num, (void *)&table);
+	dinode_t &entry = table.inodes[inode_num % INODES_PER_BLOCK];
+	unsigned int generation = entry.generation;
+	std::memset(&entry, 0, sizeof(dinode_t));
+	entry.generation = generation;
+	write_block(block_num, (void *)&table);
+	inode_map.mark_free(inode_num);
+}
+
+// Marks the inode as removed and queues its data blocks and block map,
+// then the inode itself, to be reclaimed by reclaim_orphans. Its tail
+// fragments must be freed already.
+void BasicFileSys::orphan_inode(int inode_num)
+{
+	struct inodeblock_t table;
+	short block_num = get_inode_block(inode_num);
+	read_block(block_num, (void *)&table);
+	table.inodes[inode_num % INODES_PER_BLOCK].in_use = INODE_ORPHAN;
+	write_block(block_num, (void *)&table);
+	orphans.push_back(inode_num);
+	orphan_blocks += count_orphan_blocks(inode_num);
+}
+
+// Reclaims up to max_blocks blocks of removed inodes, freeing each inode
+// once it has none left. Returns true while blocks are left to reclaim.
+bool BasicFileSys::reclaim_orphans(int max_blocks)
+{
+	if (read_only_mode) return false;
+
+	while (!orphans.empty() && max_blocks > 0) {
+		int inode_num = orphans.front();
+		struct inode_t inode;
+		read_inode(inode_num, inode);
+
+		// free data blocks from the end of the file, then drop them from
+		// the block map so a remount does not free them again
+		bool freed = false;
+		for (int i = MAX_DATA_BLOCKS - 1; i >= 0 && max_blocks > 0; i--) {
+			if (inode.blocks[i] != 0) {
+				if (!free_map.is_free(inode.blocks[i])) {
+					reclaim_block(inode.blocks[i]);
+					orphan_blocks--;
+					max_blocks--;
 				}
+				inode.blocks[i] = 0;
+				freed = true;
 			}
 		}
+		if (freed) {
+			struct mapblock_t map;
+			map.magic = MAP_MAGIC_NUM;
+			std::memcpy(map.blocks, inode.blocks, sizeof(map.blocks));
+			write_block(inode.map_block, (void *)&map);
+		}
+		if (std::any_of(inode.blocks, inode.blocks + MAX_DATA_BLOCKS, [](short block) { return block != 0; })) {
+			break;
+		}
+
+		// with the data gone, the block map and the inode go too
+		if (inode.map_block != 0) {
+			reclaim_block(inode.map_block);
+			orphan_blocks--;
+			max_blocks--;
+		}
+		reclaim_inode(inode_num);
+		orphans.pop_front();
 	}
+	return !orphans.empty();
+}
 
-	// disk is full
-	return 0;
+// Returns the number of blocks waiting for reclaim_orphans.
+int BasicFileSys::orphan_block_count() const
+{
+	return orphan_blocks;
+}
+
+// Returns true if removed files are reclaimed in the background.
+bool BasicFileSys::deferred_free() const
+{
+	return deferred_mode;
+}
+
+// Reads the inode, with its block map, into inode.
+void BasicFileSys::read_inode(int inode_num, inode_t &inode)
+{
+	struct inodeblock_t table;
+	read_block(get_inode_block(inode_num), (void *)&table);
+	const dinode_t &entry = table.inodes[inode_num % INODES_PER_BLOCK];
+	inode.size = entry.size;
+	inode.reserved = entry.reserved;
+	inode.tail_block = entry.tail_block;
+	inode.tail_offset = entry.tail_offset;
+	inode.map_block = entry.map_block;
+	inode.generation = entry.generation;
+
+	if (entry.map_block != 0) {
+		struct mapblock_t map;
+		read_block(entry.map_block, (void *)&map);
+		std::memcpy(inode.blocks, map.blocks, sizeof(inode.blocks));
+	} else {
+		std::memset(inode.blocks, 0, sizeof(inode.blocks));
+	}
+}
+
+// Writes inode as the inode, and its block list to its block map if it
+// has one.
+void BasicFileSys::write_inode(int inode_num, const inode_t &inode)
+{
+	struct inodeblock_t table;
+	short block_num = get_inode_block(inode_num);
+	read_block(block_num, (void *)&table);
+	dinode_t &entry = table.inodes[inode_num % INODES_PER_BLOCK];
+	entry.size = inode.size;
+	entry.in_use = 1;
+	entry.reserved = inode.reserved;
+	entry.tail_block = inode.tail_block;
+	entry.tail_offset = inode.tail_offset;
+	entry.map_block = inode.map_block;
+	entry.generation = inode.generation;
+	write_block(block_num, (void *)&table);
+
+	if (inode.map_block != 0) {
+		struct mapblock_t map;
+		map.magic = MAP_MAGIC_NUM;
+		std::memcpy(map.blocks, inode.blocks, sizeof(map.blocks));
+		write_block(inode.map_block, (void *)&map);
+	}
+}
+
+// Returns the inode table block holding the inode.
+short BasicFileSys::get_inode_block(int inode_num) const
+{
+	int group = inode_num / INODES_PER_GROUP;
+	return inode_table_start(group) + inode_num % INODES_PER_GROUP / INODES_PER_BLOCK;
+}
+
+// Returns the first free inode at or after a_first, wrapping around to
+// inode 0, or -1 if every inode is used.
+int BasicFileSys::free_inode_after(int a_first) const
+{
+	int inode_num = inode_map.find_free(a_first, NUM_INODES);
+	if (inode_num < 0) inode_num = inode_map.find_free(0, a_first);
+	return inode_num;
+}
+
+// Returns the first block of the group a new directory under the directory
+// a_parent should go in: the group with the most free blocks, ties going to
+// the first one after the parent's group, so that directories spread out and
+// leave room around them for their files.
+short BasicFileSys::get_dir_goal(short a_parent) const
+{
+	int parentGroup = a_parent / BLOCKS_PER_GROUP;
+	int bestGroup = parentGroup;
+	int bestFree = -1;
+	for (int i = 1; i <= NUM_GROUPS; i++) {
+		int group = (parentGroup + i) % NUM_GROUPS;
+		int first = group * BLOCKS_PER_GROUP;
+		int numFree = free_map.count_free(first, std::min(first + BLOCKS_PER_GROUP, NUM_BLOCKS));
+		if (numFree > bestFree) {
+			bestGroup = group;
+			bestFree = numFree;
+		}
+	}
+	return bestGroup * BLOCKS_PER_GROUP;
 }
 
 // Reclaims block making it available for future use.
@@ -84,26 +432,242 @@ void BasicFileSys::reclaim_block(short block_num)
 {
 	// get superblock
 	struct superblock_t super_block;
-	disk.read_block(0, (void *)&super_block);
+	read_block(0, (void *)&super_block);
 
 	// clear bit
 	int byte = block_num / 8;		// byte number
 	int bit = block_num % 8;		// bit number
 	unsigned char mask = ~(1 << bit);	// mask to clear bit
+	if (super_block.bitmap[byte] & ~mask) free_count++;
 	super_block.bitmap[byte] &= mask;
+	free_map.mark_free(block_num);
 
 	// write back superblock
-	disk.write_block(0, (void *)&super_block);
+	write_block(0, (void *)&super_block);
+}
+
+// Promises a_count free blocks to a later allocation, so that other
+// allocations cannot use them up in the meantime. Returns false if there
+// are not enough unpromised free blocks.
+bool BasicFileSys::reserve_blocks(int a_count)
+{
+	if (a_count > free_count - reserved_count && !orphans.empty()) reclaim_orphans(NUM_BLOCKS);
+	if (a_count > free_count - reserved_count) return false;
+	reserved_count += a_count;
+	return true;
+}
+
+// Releases a_count blocks promised by reserve_blocks. Call this right
+// before allocating the promised blocks.
+void BasicFileSys::release_blocks(int a_count)
+{
+	reserved_count -= a_count;
 }
 
 // Reads block from disk. Output parameter block points to new block.
+// Blocks written by an open transaction are read back from it.
 void BasicFileSys::read_block(short block_num, void *block)
 {
-	disk.read_block(block_num, block);
+	if (read_only_mode) {
+		disk.read_block(block_num, block);
+		return;
+	}
+	if (journal.active() && journal.read_block(block_num, block)) return;
+	cache.read_block(block_num, block);
 }
 
-// Writes block to disk. Input block points to block to write.
+// Writes block to disk. Input block points to block to write. While a
+// transaction is open, the block is held in it instead.
 void BasicFileSys::write_block(short block_num, void *block)
 {
-	disk.write_block(block_num, block);
+	if (journal.active()) {
+		journal.write_block(block_num, block);
+		return;
+	}
+	cache.write_block(block_num, block);
+}
+
+// Starts a transaction: blocks written from now on are held in memory
+// until it commits or aborts.
+void BasicFileSys::begin_transaction()
+{
+	journal.begin();
+	txn_reserved_count = reserved_count;
+	txn_next_fit_pos = next_fit_pos;
+}
+
+// Returns true if a transaction is open.
+bool BasicFileSys::in_transaction() const
+{
+	return journal.active();
+}
+
+// Logs the blocks written by the transaction to the journal, then writes
+// them to the disk and empties the journal again.
+void BasicFileSys::commit_transaction()
+{
+	if (journal.blocks().empty()) {
+		journal.abort();
+		return;
+	}
+
+	journal.log();
+	for (auto &block : journal.blocks()) {
+		cache.write_block(block.first, (const void *)&block.second);
+	}
+	cache.flush();
+	disk.sync();
+	journal.clear();
+}
+
+// Drops the blocks written by the transaction, and rebuilds the free block
+// and inode maps from the disk as it was before the transaction began.
+void BasicFileSys::abort_transaction()
+{
+	journal.abort();
+	load_maps();
+	reserved_count = txn_reserved_count;
+	next_fit_pos = txn_next_fit_pos;
+}
+
+// Writes every modified block out to the disk file.
+void BasicFileSys::flush()
+{
+	if (read_only_mode) return;
+	cache.flush();
+}
+
+// Writes every modified block out and waits until the disk stores them.
+void BasicFileSys::sync()
+{
+	if (read_only_mode) return;
+	cache.flush();
+	disk.sync();
+}
+
+// Reads a few blocks of the warm-up list saved by the last unmount into
+// the cache. Returns true while blocks are left to read.
+bool BasicFileSys::prefetch()
+{
+	if (read_only_mode) return false;
+	return cache.prefetch_step(PREFETCH_BATCH);
+}
+
+// Returns the block cache.
+const BlockCache &BasicFileSys::get_cache() const
+{
+	return cache;
+}
+
+// Returns the map of free blocks.
+const FreeMap &BasicFileSys::get_free_map() const
+{
+	return free_map;
+}
+
+// Rebuilds the free block and inode maps from the superblock and the inode
+// tables.
+void BasicFileSys::load_maps()
+{
+	struct superblock_t super_block;
+	read_block(0, (void *)&super_block);
+	free_map.load(super_block.bitmap, NUM_BLOCKS, BLOCKS_PER_GROUP);
+	free_count = 0;
+	for (int block = 0; block < NUM_BLOCKS; block++) {
+		if (free_map.is_free(block)) {
+			free_count++;
+		}
+	}
+
+	// find the free inodes, and queue the removed ones again
+	orphans.clear();
+	orphan_blocks = 0;
+	std::vector<unsigned char> inode_bitmap((NUM_INODES + 7) / 8, 0);
+	for (int inode_num = 0; inode_num < NUM_INODES; inode_num += INODES_PER_BLOCK) {
+		struct inodeblock_t table;
+		read_block(get_inode_block(inode_num), (void *)&table);
+		for (int i = 0; i < INODES_PER_BLOCK; i++) {
+			if (table.inodes[i].in_use) {
+				inode_bitmap[(inode_num + i) / 8] |= 1 << ((inode_num + i) % 8);
+			}
+			if (table.inodes[i].in_use == INODE_ORPHAN) {
+				orphans.push_back(inode_num + i);
+			}
+		}
+	}
+	inode_map.load(inode_bitmap.data(), NUM_INODES, INODES_PER_GROUP);
+	for (int orphan : orphans) {
+		drop_free_orphan_blocks(orphan);
+		orphan_blocks += count_orphan_blocks(orphan);
+	}
+}
+
+// Drops the blocks a crash left free in the bitmap from the removed inode's
+// block map. Once free they can go to another file, and reclaim_orphans
+// would then free them out from under it.
+void BasicFileSys::drop_free_orphan_blocks(int a_inode_num)
+{
+	struct inodeblock_t table;
+	short table_block = get_inode_block(a_inode_num);
+	read_block(table_block, (void *)&table);
+	dinode_t &entry = table.inodes[a_inode_num % INODES_PER_BLOCK];
+	if (entry.map_block == 0) return;
+
+	// a free block map cannot be trusted to list anything
+	if (free_map.is_free(entry.map_block)) {
+		entry.map_block = 0;
+		write_block(table_block, (void *)&table);
+		return;
+	}
+
+	struct mapblock_t map;
+	read_block(entry.map_block, (void *)&map);
+	bool dropped = false;
+	for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
+		if (map.blocks[i] != 0 && free_map.is_free(map.blocks[i])) {
+			map.blocks[i] = 0;
+			dropped = true;
+		}
+	}
+	if (dropped) {
+		write_block(entry.map_block, (void *)&map);
+	}
+}
+
+// Returns the number of the removed inode's blocks still to reclaim.
+int BasicFileSys::count_orphan_blocks(int a_inode_num)
+{
+	struct inode_t inode;
+	read_inode(a_inode_num, inode);
+	if (inode.map_block == 0) return 0;
+	int count = 1;
+	for (int i = 0; i < MAX_DATA_BLOCKS; i++) {
+		if (inode.blocks[i] != 0 && !free_map.is_free(inode.blocks[i])) count++;
+	}
+	return count;
+}
+
+// Returns true if the disk bypasses the kernel page cache.
+bool BasicFileSys::direct_io() const
+{
+	return disk.direct();
+}
+
+// Returns true if new blocks are taken next-fit, sweeping across the disk.
+bool BasicFileSys::next_fit() const
+{
+	return next_fit_mode;
+}
+
+// Returns true if the disk is mapped read-only.
+bool BasicFileSys::read_only() const
+{
+	return read_only_mode;
+}
+
+// Returns the bytes of block block_num straight from the mapped disk of
+// a read-only mount, or nullptr if the disk is not mapped.
+const char *BasicFileSys::mapped_block(short block_num) const
+{
+	return disk.mapped_block(block_num);
 }
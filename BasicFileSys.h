@@ -5,7 +5,31 @@
 #ifndef BASIC_FILESYS_H
 #define BASIC_FILESYS_H
 
+#include <deque>  // deque
+#include <string>  // string
+
+#include "BlockCache.h"
+#include "Blocks.h"
 #include "Disk.h"
+#include "FreeMap.h"
+#include "Journal.h"
+
+// Number of blocks of removed files reclaimed per step in the background
+const int RECLAIM_BATCH = 8;
+
+// Settings chosen when the file system is mounted
+struct MountOptions
+{
+	std::string disk_file = "DISK";	// file holding the disk, its journal and warm-up list are named after it
+	bool huge_pages = true;	// back the block cache with huge pages if available
+	int cache_blocks = CACHE_BLOCKS;	// initial size of the block cache
+	int cache_min_blocks = MIN_CACHE_BLOCKS;	// the block cache never shrinks below this
+	int cache_max_blocks = MAX_CACHE_BLOCKS;	// the block cache never grows above this
+	bool direct_io = false;	// bypass the kernel page cache, so blocks are only cached once
+	bool next_fit = false;	// take each new block from where the last allocation ended instead of near related blocks
+	bool deferred_free = false;	// reclaim the blocks of removed files in the background
+	bool read_only = false;	// map the existing disk read-only, without the journal or the cache
+};
 
 // Basic File
 class BasicFileSys
@@ -13,25 +37,148 @@ class BasicFileSys
 public:
 	// Mounts the disk.  If the disk is new, it formats the disk by
 	// initializing special blocks 0 (superblock) and 1 (root directory).
-	void mount();
+	void mount(const MountOptions &options);
 
 	// Unmounts the disk.
 	void unmount();
 
-	// Gets a free block from the disk.
-	short get_free_block();
+	// Gets a free block from the disk, the first one after a_goal in its block
+	// group if there is one, else the first one in the group, else the first
+	// one in the groups after it. In next-fit mode the goal is ignored and the
+	// block is the first free one at or after where the last allocation ended.
+	short get_free_block(short a_goal = 0);
+
+	// Gets a run of a_count contiguous free blocks from the disk, taken from the
+	// front of the shortest free run in a_goal's block group that is long
+	// enough, or else the shortest one on the disk. In next-fit mode it is the
+	// first long enough run at or after where the last allocation ended instead.
+	// Returns the first block of the run, or 0 if no run of that length is
+	// available.
+	short get_free_extent(int a_count, short a_goal = 0);
+
+	// Returns the first block of the group a new directory under the
+	// directory a_parent should go in, spreading directories across groups.
+	short get_dir_goal(short a_parent) const;
+
+	// Gets a free inode, in a_goal's block group if it has one, else in the
+	// groups after it. Returns the inode number, or -1 if every inode is used.
+	int get_free_inode(short a_goal = 0);
+
+	// Frees the inode for reuse. Its data blocks and block map are not
+	// reclaimed, and its generation is kept for the next file to carry on.
+	void reclaim_inode(int inode_num);
+
+	// Marks the inode as removed and queues its data blocks and block map,
+	// then the inode itself, to be reclaimed by reclaim_orphans. Its tail
+	// fragments must be freed already.
+	void orphan_inode(int inode_num);
+
+	// Reclaims up to max_blocks blocks of removed inodes, freeing each inode
+	// once it has none left. Returns true while blocks are left to reclaim.
+	bool reclaim_orphans(int max_blocks);
+
+	// Returns the number of blocks waiting for reclaim_orphans.
+	int orphan_block_count() const;
+
+	// Returns true if removed files are reclaimed in the background.
+	bool deferred_free() const;
+
+	// Reads the inode, with its block map, into inode.
+	void read_inode(int inode_num, inode_t &inode);
+
+	// Writes inode as the inode, and its block list to its block map if it
+	// has one.
+	void write_inode(int inode_num, const inode_t &inode);
+
+	// Returns the inode table block holding the inode.
+	short get_inode_block(int inode_num) const;
 
 	// Reclaims block making it available for future use.
 	void reclaim_block(short block_num);
 
+	// Promises a_count free blocks to a later allocation, so that other
+	// allocations cannot use them up in the meantime. Returns false if there
+	// are not enough unpromised free blocks.
+	bool reserve_blocks(int a_count);
+
+	// Releases a_count blocks promised by reserve_blocks. Call this right
+	// before allocating the promised blocks.
+	void release_blocks(int a_count);
+
 	// Reads block from disk. Output parameter block points to new block.
+	// Blocks written by an open transaction are read back from it.
 	void read_block(short block_num, void *block);
 
-	// Writes block to disk. Input block points to block to write.
+	// Writes block to disk. Input block points to block to write. While a
+	// transaction is open, the block is held in it instead.
 	void write_block(short block_num, void *block);
 
+	// Starts a transaction: blocks written from now on are held in memory
+	// until it commits or aborts.
+	void begin_transaction();
+
+	// Returns true if a transaction is open.
+	bool in_transaction() const;
+
+	// Logs the blocks written by the transaction to the journal, then writes
+	// them to the disk and empties the journal again.
+	void commit_transaction();
+
+	// Drops the blocks written by the transaction, and rebuilds the free block
+	// and inode maps from the disk as it was before the transaction began.
+	void abort_transaction();
+
+	// Writes every modified block out to the disk file.
+	void flush();
+
+	// Writes every modified block out and waits until the disk stores them.
+	void sync();
+
+	// Reads a few blocks of the warm-up list saved by the last unmount into
+	// the cache. Returns true while blocks are left to read.
+	bool prefetch();
+
+	// Returns the block cache.
+	const BlockCache &get_cache() const;
+
+	// Returns the map of free blocks.
+	const FreeMap &get_free_map() const;
+
+	// Returns true if the disk bypasses the kernel page cache.
+	bool direct_io() const;
+
+	// Returns true if new blocks are taken next-fit, sweeping across the disk.
+	bool next_fit() const;
+
+	// Returns true if the disk is mapped read-only.
+	bool read_only() const;
+
+	// Returns the bytes of block block_num straight from the mapped disk of
+	// a read-only mount, or nullptr if the disk is not mapped.
+	const char *mapped_block(short block_num) const;
+
 private:
+	int free_inode_after(int a_first) const;	// returns the first free inode at or after a_first, wrapping around
+	void load_maps();	// rebuilds the free block and inode maps and the orphan queue from the superblock and inode tables
+	void drop_free_orphan_blocks(int a_inode_num);	// clears the block map entries of a removed inode that are already free
+	int count_orphan_blocks(int a_inode_num);	// returns the number of the removed inode's blocks still to reclaim
+
 	Disk disk;
+	BlockCache cache;	// blocks are read and written through the cache
+	Journal journal;	// holds the blocks of an open transaction
+	FreeMap free_map;	// summary of the superblock bitmap for finding free blocks
+	FreeMap inode_map;	// which inodes are free, built from the inode tables at mount
+	int free_count;		// number of free blocks in the bitmap
+	int reserved_count;	// number of free blocks promised by reserve_blocks
+	int txn_reserved_count;	// reserved_count when the open transaction began
+	bool next_fit_mode;	// true if blocks are allocated next-fit instead of by block group
+	int next_fit_pos;	// block the next search starts from in next-fit mode, wrapping around past the end of the disk
+	int txn_next_fit_pos;	// next_fit_pos when the open transaction began
+	bool deferred_mode;	// true if removed files are reclaimed in the background
+	bool read_only_mode;	// true if the disk is mapped read-only and nothing is ever written
+	std::string disk_file;	// file holding the disk
+	std::deque<int> orphans;	// removed inodes whose blocks are still to be reclaimed, oldest first
+	int orphan_blocks;	// number of blocks of the orphans still to be reclaimed
 };
 
 #endif
@@ -0,0 +1,572 @@
+// CPSC 3500: Block Cache
+// Keeps recently used disk blocks in memory and writes modified blocks
+// back to the disk lazily.
+
+#include "BlockCache.h"
+
+#include <algorithm>  // sort, min, max
+#include <cstdlib>  // exit, atof
+#include <cstring>  // memcpy, memset
+#include <fstream>  // ifstream
+#include <functional>  // greater
+#include <iostream>  // cout, cerr, endl
+
+#if _WIN32
+#include <malloc.h>  // _aligned_malloc, _aligned_free
+#else
+#include <sys/mman.h>  // mmap, munmap, madvise
+#include <unistd.h>  // sysconf
+#endif
+
+
+namespace
+{
+	// Size of an explicit huge page
+	const std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+	// Share of time some task stalled on memory that counts as pressure
+	const double PRESSURE_STALL_PERCENT = 10.0;
+
+	// Share of the cgroup memory limit in use that counts as pressure
+	const unsigned long long PRESSURE_CGROUP_PERCENT = 90;
+
+
+	// Maps a_size bytes of zeroed, page aligned memory. With a_hugePages it
+	// first tries explicit huge pages, then asks for transparent ones.
+	// a_size is updated to the mapped length and a_kind to the backing used.
+	void *map_memory(std::size_t &a_size, bool a_hugePages, const char *&a_kind)
+	{
+		a_kind = "none";
+#if _WIN32
+		(void)a_hugePages;
+		void *mem = _aligned_malloc(a_size, CACHE_LINE_SIZE);
+		if (mem) std::memset(mem, 0, a_size);
+		return mem;
+#else
+#ifdef MAP_HUGETLB
+		if (a_hugePages) {
+			std::size_t hugeSize = (a_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+			void *mem = mmap(0, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (mem != MAP_FAILED) {
+				a_size = hugeSize;
+				a_kind = "hugetlb";
+				return mem;
+			}
+		}
+#endif
+		void *mem = mmap(0, a_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) return 0;
+#ifdef MADV_HUGEPAGE
+		if (a_hugePages && madvise(mem, a_size, MADV_HUGEPAGE) == 0) {
+			a_kind = "thp";
+		}
+#endif
+		return mem;
+#endif
+	}
+
+
+	// Releases memory returned by map_memory.
+	void unmap_memory(void *a_mem, std::size_t a_size)
+	{
+		if (!a_mem) return;
+#if _WIN32
+		(void)a_size;
+		_aligned_free(a_mem);
+#else
+		munmap(a_mem, a_size);
+#endif
+	}
+
+
+	// Hands the whole pages inside a_size bytes at a_mem back to the system.
+	// They read back as zeros when touched again.
+	void release_memory(char *a_mem, std::size_t a_size)
+	{
+#if _WIN32
+		(void)a_mem;
+		(void)a_size;
+#else
+		std::size_t page = sysconf(_SC_PAGESIZE);
+		std::size_t start = (reinterpret_cast<std::size_t>(a_mem) + page - 1) / page * page;
+		std::size_t end = (reinterpret_cast<std::size_t>(a_mem) + a_size) / page * page;
+		if (start < end) {
+			madvise(reinterpret_cast<void *>(start), end - start, MADV_DONTNEED);
+		}
+#endif
+	}
+
+
+	// Checks the host for memory pressure: first the share of the last ten
+	// seconds some task stalled on memory, then the cgroup's memory use
+	// against its limit. Describes the pressure found in a_reason.
+	bool under_memory_pressure(std::string &a_reason)
+	{
+		std::ifstream psi("/proc/pressure/memory");
+		std::string word;
+		if (psi >> word && word == "some" && psi >> word && word.compare(0, 6, "avg10=") == 0) {
+			double stall = std::atof(word.c_str() + 6);
+			if (stall >= PRESSURE_STALL_PERCENT) {
+				a_reason = "memory pressure, " + word.substr(6) + "% stalled";
+				return true;
+			}
+		}
+
+		std::ifstream current("/sys/fs/cgroup/memory.current");
+		std::ifstream limit("/sys/fs/cgroup/memory.max");
+		unsigned long long used;
+		unsigned long long max;
+		if (current >> used && limit >> max && max > 0 && used * 100 >= max * PRESSURE_CGROUP_PERCENT) {
+			a_reason = "memory pressure, cgroup at " + std::to_string(used * 100 / max) + "% of its limit";
+			return true;
+		}
+
+		return false;
+	}
+}
+
+
+BlockCache::BlockCache() :
+	_disk(0),
+	_capacity(0),
+	_minCapacity(0),
+	_maxCapacity(0),
+	_used(0),
+	_headers(0),
+	_arena(0),
+	_headersSize(0),
+	_arenaSize(0),
+	_hugePages("none"),
+	_frameOf(),
+	_freeFrames(),
+	_head(),
+	_tail(),
+	_listSize(),
+	_evictedAt(),
+	_evictions(0),
+	_hits(0),
+	_misses(0),
+	_ghostHits(0),
+	_windowHits(0),
+	_windowMisses(0),
+	_windowGhostHits(0),
+	_resizes(0),
+	_lastDecision("none"),
+	_prefetched(0),
+	_prefetchQueue()
+{}
+
+BlockCache::~BlockCache()
+{
+	unmap_memory(_headers, _headersSize);
+	unmap_memory(_arena, _arenaSize);
+}
+
+// Attaches the cache to a mounted disk. The cache starts out holding
+// a_capacity blocks and resizes itself between a_minCapacity and
+// a_maxCapacity. Its arena is backed by huge pages if a_hugePages is set
+// and the system provides them.
+void BlockCache::mount(Disk *a_disk, std::size_t a_capacity, std::size_t a_minCapacity, std::size_t a_maxCapacity, bool a_hugePages)
+{
+	_disk = a_disk;
+	_minCapacity = std::max<std::size_t>(a_minCapacity, 1);
+	_maxCapacity = std::max(a_maxCapacity, _minCapacity);
+	_capacity = std::min(std::max(a_capacity, _minCapacity), _maxCapacity);
+	_used = 0;
+	for (int list = 0; list < kNumLists; list++) {
+		_head[list] = -1;
+		_tail[list] = -1;
+		_listSize[list] = 0;
+	}
+	_frameOf.assign(NUM_BLOCKS, -1);
+	_evictedAt.assign(NUM_BLOCKS, 0);
+
+	// map frames for the largest size up front, pages are only backed once used
+	const char *kind;
+	_headersSize = _maxCapacity * sizeof(FrameHeader);
+	_headers = static_cast<FrameHeader *>(map_memory(_headersSize, false, kind));
+	_arenaSize = _maxCapacity * BLOCK_SIZE;
+	_arena = static_cast<char *>(map_memory(_arenaSize, a_hugePages, _hugePages));
+	if (!_headers || !_arena) {
+		std::cerr << "Could not allocate block cache" << std::endl;
+		exit(-1);
+	}
+
+	_freeFrames.clear();
+	for (std::size_t frame = _maxCapacity; frame-- > 0;) {
+		_headers[frame].block_num = -1;
+		if (frame < _capacity) {
+			_freeFrames.push_back(frame);
+		}
+	}
+}
+
+// Writes back every modified block, empties the cache and frees its arena.
+void BlockCache::unmount()
+{
+	flush();
+	unmap_memory(_headers, _headersSize);
+	unmap_memory(_arena, _arenaSize);
+	_headers = 0;
+	_arena = 0;
+	_used = 0;
+	for (int list = 0; list < kNumLists; list++) {
+		_head[list] = -1;
+		_tail[list] = -1;
+		_listSize[list] = 0;
+	}
+	_frameOf.clear();
+	_freeFrames.clear();
+	_prefetchQueue.clear();
+}
+
+// Reads block block_num into block, from memory if it is cached.
+void BlockCache::read_block(int block_num, void *block)
+{
+	std::memcpy(block, data(load(block_num, true)), BLOCK_SIZE);
+}
+
+// Stores block as the new contents of block block_num. The disk is only
+// written when the block is evicted or flushed.
+void BlockCache::write_block(int block_num, const void *block)
+{
+	int frame = load(block_num, false);
+	std::memcpy(data(frame), block, BLOCK_SIZE);
+	_headers[frame].dirty = true;
+
+	// a reused block may have turned from data into metadata or back
+	bool metadata = is_metadata(frame);
+	if (metadata != (_headers[frame].list == kMetadata)) {
+		unlink(frame);
+		push_front(frame, metadata ? kMetadata : kProtected);
+	}
+}
+
+// Writes every modified block back to the disk, in block order.
+void BlockCache::flush()
+{
+	std::vector<int> dirty;
+	for (std::size_t frame = 0; frame < _capacity; frame++) {
+		if (_headers[frame].block_num >= 0 && _headers[frame].dirty) {
+			dirty.push_back(frame);
+		}
+	}
+	std::sort(dirty.begin(), dirty.end(), [this](int a_lhs, int a_rhs) -> bool
+	{
+		return _headers[a_lhs].block_num < _headers[a_rhs].block_num;
+	});
+
+	std::vector<BlockWrite> writes(dirty.size());
+	for (std::size_t i = 0; i < dirty.size(); i++) {
+		writes[i].block_num = _headers[dirty[i]].block_num;
+		writes[i].block = data(dirty[i]);
+		_headers[dirty[i]].dirty = false;
+	}
+	_disk->write_blocks(writes);
+}
+
+// Returns how the frame arena is backed: "hugetlb", "thp" or "none".
+const char *BlockCache::huge_pages() const
+{
+	return _hugePages;
+}
+
+// Returns up to a_count cached block numbers, hottest first: metadata,
+// then blocks used more than once, then the rest, each most recently used
+// first.
+std::vector<int> BlockCache::hot_blocks(std::size_t a_count) const
+{
+	static const List order[] = { kMetadata, kProtected, kProbation };
+
+	std::vector<int> blocks;
+	for (List list : order) {
+		for (int frame = _head[list]; frame >= 0 && blocks.size() < a_count; frame = _headers[frame].next) {
+			blocks.push_back(_headers[frame].block_num);
+		}
+	}
+	return blocks;
+}
+
+// Queues blocks to be read in ahead of use by prefetch_step, in block
+// order so the disk is read front to back. Only as many of the first
+// blocks as there are free frames are queued.
+void BlockCache::prefetch(const std::vector<int> &a_blocks)
+{
+	// a_blocks is hottest first, so keep the head of it that fits
+	_prefetchQueue.clear();
+	for (int block_num : a_blocks) {
+		if (_prefetchQueue.size() == _freeFrames.size()) {
+			break;
+		}
+		if (block_num >= 0 && block_num < NUM_BLOCKS) {
+			_prefetchQueue.push_back(block_num);
+		}
+	}
+
+	// the queue is taken from the back
+	std::sort(_prefetchQueue.begin(), _prefetchQueue.end(), std::greater<int>());
+	_prefetchQueue.erase(std::unique(_prefetchQueue.begin(), _prefetchQueue.end()), _prefetchQueue.end());
+}
+
+// Reads up to a_count queued blocks into free frames. Nothing is evicted to
+// make room. Returns true while blocks are left in the queue.
+bool BlockCache::prefetch_step(std::size_t a_count)
+{
+	while (a_count > 0 && !_prefetchQueue.empty()) {
+		if (_freeFrames.empty()) {
+			_prefetchQueue.clear();
+			break;
+		}
+
+		int block_num = _prefetchQueue.back();
+		_prefetchQueue.pop_back();
+		if (_frameOf[block_num] >= 0) {
+			continue;
+		}
+
+		// the block was hot before the restart, so it skips probation, but
+		// it does not count toward the working set until it is used
+		int frame = _freeFrames.back();
+		_freeFrames.pop_back();
+		_used++;
+		_headers[frame].block_num = block_num;
+		_headers[frame].dirty = false;
+		_headers[frame].referenced = false;
+		_disk->read_block(block_num, data(frame));
+		_frameOf[block_num] = frame;
+		push_front(frame, is_metadata(frame) ? kMetadata : kProtected);
+		_prefetched++;
+		a_count--;
+	}
+	return !_prefetchQueue.empty();
+}
+
+// Prints the cache size, its bounds, hit counts and the last sizing
+// decision, one per line.
+void BlockCache::print_stats(std::ostream &os) const
+{
+	unsigned long accesses = _hits + _misses;
+	os << "Cache capacity: " << _capacity << " blocks (min " << _minCapacity << ", max " << _maxCapacity << ")\n";
+	os << "Cached blocks: " << _used << '\n';
+	os << "Hits: " << _hits << '\n';
+	os << "Misses: " << _misses << '\n';
+	os << "Ghost hits: " << _ghostHits << '\n';
+	os << "Probation blocks: " << _listSize[kProbation] << '\n';
+	os << "Protected blocks: " << _listSize[kProtected] << '\n';
+	os << "Metadata blocks: " << _listSize[kMetadata] << '\n';
+	os << "Hit rate: " << (accesses == 0 ? 0 : _hits * 100 / accesses) << "%\n";
+	os << "Prefetched: " << _prefetched << '\n';
+	os << "Resizes: " << _resizes << '\n';
+	os << "Last sizing decision: " << _lastDecision << '\n';
+	os << "Huge pages: " << _hugePages << '\n';
+}
+
+// Returns the frame for the block, evicting another if full. The contents
+// are read from the disk on a miss only if a_read is set.
+int BlockCache::load(int block_num, bool a_read)
+{
+	if (_windowHits + _windowMisses >= CACHE_SIZING_WINDOW) {
+		adapt();
+	}
+
+	int frame = _frameOf[block_num];
+	if (frame >= 0) {
+		_hits++;
+		_windowHits++;
+		_headers[frame].referenced = true;
+		List list = static_cast<List>(_headers[frame].list);
+		unlink(frame);
+		push_front(frame, list == kProbation ? kProtected : list);
+		return frame;
+	}
+
+	_misses++;
+	_windowMisses++;
+	List list = kProbation;
+	if (_evictedAt[block_num] != 0) {
+		unsigned long age = _evictions - _evictedAt[block_num];
+		if (age < _maxCapacity - _capacity) {
+			_ghostHits++;
+			_windowGhostHits++;
+		}
+		// used again soon after falling out of the cache, so not part of a scan
+		if (age < _capacity / 2) {
+			list = kProtected;
+		}
+	}
+
+	if (_freeFrames.empty()) {
+		evict();
+	}
+	frame = _freeFrames.back();
+	_freeFrames.pop_back();
+	_used++;
+
+	_headers[frame].block_num = block_num;
+	_headers[frame].dirty = false;
+	_headers[frame].referenced = true;
+	if (a_read) {
+		_disk->read_block(block_num, data(frame));
+		if (is_metadata(frame)) {
+			list = kMetadata;
+		}
+	}
+	_frameOf[block_num] = frame;
+	push_front(frame, list);
+	return frame;
+}
+
+// Drops the block the replacement policy picks, writing it back if dirty.
+void BlockCache::evict()
+{
+	int frame = _tail[victim_list()];
+	FrameHeader &header = _headers[frame];
+	unlink(frame);
+	if (header.dirty) {
+		_disk->write_block(header.block_num, data(frame));
+	}
+	_frameOf[header.block_num] = -1;
+	_evictedAt[header.block_num] = ++_evictions;
+	header.block_num = -1;
+	_used--;
+	_freeFrames.push_back(frame);
+}
+
+// Sets the number of frames. Shrinking evicts blocks in replacement order,
+// moves the rest below the new size and returns the memory past it.
+void BlockCache::resize(std::size_t a_capacity, const std::string &a_reason)
+{
+	std::size_t oldCapacity = _capacity;
+	while (_used > a_capacity) {
+		evict();
+	}
+
+	std::vector<int> freeFrames;
+	for (std::size_t frame = std::min(oldCapacity, a_capacity); frame-- > 0;) {
+		if (_headers[frame].block_num < 0) {
+			freeFrames.push_back(frame);
+		}
+	}
+	for (std::size_t frame = a_capacity; frame < oldCapacity; frame++) {
+		if (_headers[frame].block_num < 0) {
+			continue;
+		}
+
+		int to = freeFrames.back();
+		freeFrames.pop_back();
+		_headers[to] = _headers[frame];
+		std::memcpy(data(to), data(frame), BLOCK_SIZE);
+		if (_headers[to].prev >= 0) _headers[_headers[to].prev].next = to;
+		else _head[_headers[to].list] = to;
+		if (_headers[to].next >= 0) _headers[_headers[to].next].prev = to;
+		else _tail[_headers[to].list] = to;
+		_frameOf[_headers[to].block_num] = to;
+		_headers[frame].block_num = -1;
+	}
+	for (std::size_t frame = a_capacity; frame-- > oldCapacity;) {
+		_headers[frame].block_num = -1;
+		freeFrames.push_back(frame);
+	}
+	if (a_capacity < oldCapacity) {
+		release_memory(data(a_capacity), (oldCapacity - a_capacity) * BLOCK_SIZE);
+	}
+
+	_freeFrames.swap(freeFrames);
+	_capacity = a_capacity;
+	_resizes++;
+	_lastDecision = std::to_string(oldCapacity) + " -> " + std::to_string(a_capacity) + " blocks (" + a_reason + ")";
+	std::cout << "Block cache resized from " << _lastDecision << std::endl;
+}
+
+// Picks a new capacity from the last sizing window: shrink under memory
+// pressure, grow while recently evicted blocks keep being missed, and shrink
+// toward the working set while nearly everything hits.
+void BlockCache::adapt()
+{
+	std::size_t workingSet = 0;
+	for (std::size_t frame = 0; frame < _capacity; frame++) {
+		if (_headers[frame].block_num >= 0 && _headers[frame].referenced) {
+			workingSet++;
+		}
+		_headers[frame].referenced = false;
+	}
+
+	std::string reason;
+	std::size_t target = _capacity;
+	if (under_memory_pressure(reason)) {
+		target = _capacity - _capacity / 4;
+	} else if (_windowGhostHits > 0 && _windowGhostHits * 4 >= _windowMisses) {
+		target = _capacity + std::max<std::size_t>(_windowGhostHits, _capacity / 4);
+		reason = std::to_string(_windowGhostHits) + " of " + std::to_string(_windowMisses) + " misses were recently evicted";
+	} else if (_windowMisses * 20 <= CACHE_SIZING_WINDOW && workingSet + workingSet / 4 < _capacity / 2) {
+		target = workingSet + workingSet / 4;
+		reason = "working set of " + std::to_string(workingSet) + " blocks";
+	}
+	target = std::min(std::max(target, _minCapacity), _maxCapacity);
+
+	_windowHits = 0;
+	_windowMisses = 0;
+	_windowGhostHits = 0;
+	if (target != _capacity) {
+		resize(target, reason);
+	}
+}
+
+// Returns the list to evict from. Metadata is kept unless it holds more
+// than its share of the cache or nothing else is left. Of the rest,
+// probation goes first while it holds at least its share, so blocks used
+// only once never push out blocks that were used again.
+BlockCache::List BlockCache::victim_list() const
+{
+	if (_listSize[kMetadata] > _capacity * CACHE_METADATA_PERCENT / 100) {
+		return kMetadata;
+	}
+	if (_listSize[kProbation] > 0 && (_listSize[kProbation] >= _capacity * CACHE_PROBATION_PERCENT / 100 || _listSize[kProtected] == 0)) {
+		return kProbation;
+	}
+	if (_listSize[kProtected] > 0) {
+		return kProtected;
+	}
+	return kMetadata;
+}
+
+// Returns true if the frame holds the superblock, a directory, inodes or a
+// block map.
+bool BlockCache::is_metadata(int a_frame) const
+{
+	if (_headers[a_frame].block_num == 0) {
+		return true;
+	}
+	unsigned int magic;
+	std::memcpy(&magic, data(a_frame), sizeof(magic));
+	return magic == DIR_MAGIC_NUM || magic == DIR_DATA_MAGIC_NUM || magic == INODE_MAGIC_NUM || magic == MAP_MAGIC_NUM;
+}
+
+// Removes the frame from its LRU list.
+void BlockCache::unlink(int a_frame)
+{
+	FrameHeader &header = _headers[a_frame];
+	if (header.prev >= 0) _headers[header.prev].next = header.next;
+	else _head[header.list] = header.next;
+	if (header.next >= 0) _headers[header.next].prev = header.prev;
+	else _tail[header.list] = header.prev;
+	_listSize[header.list]--;
+}
+
+// Makes the frame the most recently used of the list.
+void BlockCache::push_front(int a_frame, List a_list)
+{
+	_headers[a_frame].list = a_list;
+	_headers[a_frame].prev = -1;
+	_headers[a_frame].next = _head[a_list];
+	if (_head[a_list] >= 0) _headers[_head[a_list]].prev = a_frame;
+	_head[a_list] = a_frame;
+	if (_tail[a_list] < 0) _tail[a_list] = a_frame;
+	_listSize[a_list]++;
+}
+
+// Returns the contents of the frame.
+char *BlockCache::data(int a_frame) const
+{
+	return _arena + static_cast<std::size_t>(a_frame) * BLOCK_SIZE;
+}
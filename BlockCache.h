@@ -0,0 +1,164 @@
+// CPSC 3500: Block Cache
+// Keeps recently used disk blocks in memory and writes modified blocks
+// back to the disk lazily.
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <cstddef>  // size_t
+#include <ostream>  // ostream
+#include <string>  // string
+#include <vector>  // vector
+
+#include "Blocks.h"
+#include "Disk.h"
+
+// Default number of blocks held by the cache
+const int CACHE_BLOCKS = (NUM_BLOCKS / 4);
+
+// Default bounds on the number of blocks held by the cache
+const int MIN_CACHE_BLOCKS = (NUM_BLOCKS / 16);
+const int MAX_CACHE_BLOCKS = NUM_BLOCKS;
+
+// Number of cache accesses between sizing decisions
+const int CACHE_SIZING_WINDOW = 256;
+
+// Share of the cache, in percent, kept for blocks seen only once before
+// they are evicted ahead of blocks seen again
+const int CACHE_PROBATION_PERCENT = 25;
+
+// Share of the cache, in percent, that metadata blocks may hold before
+// they are evicted like other blocks
+const int CACHE_METADATA_PERCENT = 50;
+
+// Size of a CPU cache line
+const int CACHE_LINE_SIZE = 64;
+
+// Number of hot blocks remembered across a restart
+const int WARM_LIST_BLOCKS = (NUM_BLOCKS / 8);
+
+// Number of warm-up blocks read between checks for new requests
+const int PREFETCH_BATCH = 8;
+
+class BlockCache
+{
+public:
+	BlockCache();
+	~BlockCache();
+
+	// Attaches the cache to a mounted disk. The cache starts out holding
+	// a_capacity blocks and resizes itself between a_minCapacity and
+	// a_maxCapacity. Its arena is backed by huge pages if a_hugePages is set
+	// and the system provides them.
+	void mount(Disk *a_disk, std::size_t a_capacity, std::size_t a_minCapacity, std::size_t a_maxCapacity, bool a_hugePages);
+
+	// Writes back every modified block, empties the cache and frees its arena.
+	void unmount();
+
+	// Reads block block_num into block, from memory if it is cached.
+	void read_block(int block_num, void *block);
+
+	// Stores block as the new contents of block block_num. The disk is only
+	// written when the block is evicted or flushed.
+	void write_block(int block_num, const void *block);
+
+	// Writes every modified block back to the disk, in block order.
+	void flush();
+
+	// Returns how the frame arena is backed: "hugetlb", "thp" or "none".
+	const char *huge_pages() const;
+
+	// Returns up to a_count cached block numbers, hottest first: metadata,
+	// then blocks used more than once, then the rest, each most recently
+	// used first.
+	std::vector<int> hot_blocks(std::size_t a_count) const;
+
+	// Queues blocks to be read in ahead of use by prefetch_step, in block
+	// order so the disk is read front to back. Only as many of the first
+	// blocks as there are free frames are queued.
+	void prefetch(const std::vector<int> &a_blocks);
+
+	// Reads up to a_count queued blocks into free frames. Nothing is evicted
+	// to make room. Returns true while blocks are left in the queue.
+	bool prefetch_step(std::size_t a_count);
+
+	// Prints the cache size, its bounds, hit counts and the last sizing
+	// decision, one per line.
+	void print_stats(std::ostream &os) const;
+
+private:
+	// Blocks are kept in one of three LRU lists. New blocks start in
+	// probation and move to protected when used again, so a scan that reads
+	// each block once only cycles through probation. Metadata blocks (the
+	// superblock, directories, inode tables and block maps) have a list of
+	// their own that is evicted last.
+	enum List
+	{
+		kProbation = 0,
+		kProtected,
+		kMetadata,
+		kNumLists
+	};
+
+
+	// Bookkeeping for one frame. Headers live apart from the frame data,
+	// one per cache line, so LRU updates never touch block contents.
+	struct alignas(CACHE_LINE_SIZE) FrameHeader
+	{
+		int block_num;	// cached block number, -1 if the frame is free
+		int prev;	// more recently used frame, -1 at the head
+		int next;	// less recently used frame, -1 at the tail
+		bool dirty;	// true if the contents are newer than the disk
+		bool referenced;	// true if used in the current sizing window
+		unsigned char list;	// LRU list holding the frame
+	};
+
+
+	int load(int block_num, bool a_read);	// returns the frame for the block, evicting another if full
+	void evict();	// drops the block the replacement policy picks, writing it back if dirty
+	List victim_list() const;	// returns the list to evict from
+	void resize(std::size_t a_capacity, const std::string &a_reason);	// sets the number of frames, evicting blocks if it shrinks
+	void adapt();	// picks a new capacity from the last sizing window
+	bool is_metadata(int a_frame) const;	// returns true if the frame holds the superblock, a directory, inodes or a block map
+	void unlink(int a_frame);	// removes the frame from its LRU list
+	void push_front(int a_frame, List a_list);	// makes the frame the most recently used of the list
+	char *data(int a_frame) const;	// returns the contents of the frame
+
+
+	Disk *_disk;
+	std::size_t _capacity;	// number of frames in use or free for use
+	std::size_t _minCapacity;	// lower bound on _capacity
+	std::size_t _maxCapacity;	// upper bound on _capacity, and frames mapped
+	std::size_t _used;	// number of frames holding a block
+	FrameHeader *_headers;	// frame headers, _maxCapacity of them
+	char *_arena;	// frame data, BLOCK_SIZE bytes per frame
+	std::size_t _headersSize;	// bytes mapped for the headers
+	std::size_t _arenaSize;	// bytes mapped for the arena
+	const char *_hugePages;	// how the arena is backed
+	std::vector<int> _frameOf;	// frame holding each block number, -1 if not cached
+	std::vector<int> _freeFrames;	// frames below _capacity holding no block
+	int _head[kNumLists];	// most recently used frame of each list
+	int _tail[kNumLists];	// least recently used frame of each list
+	std::size_t _listSize[kNumLists];	// number of frames in each list
+
+	// ghost entries: the eviction each block was last dropped by, so a miss
+	// on a block evicted recently enough counts as a would-be hit, and goes
+	// straight to the protected list
+	std::vector<unsigned long> _evictedAt;
+	unsigned long _evictions;
+
+	// statistics, totals and for the current sizing window
+	unsigned long _hits;
+	unsigned long _misses;
+	unsigned long _ghostHits;
+	unsigned long _windowHits;
+	unsigned long _windowMisses;
+	unsigned long _windowGhostHits;
+	unsigned long _resizes;
+	std::string _lastDecision;
+	unsigned long _prefetched;
+
+	std::vector<int> _prefetchQueue;	// blocks left to prefetch, last one first
+};
+
+#endif
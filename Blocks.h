@@ -12,20 +12,66 @@ const int BLOCK_SIZE = 128;
 const int NUM_BLOCKS = (BLOCK_SIZE * 8);
 
 // Maximum filename size
-const int MAX_FNAME_SIZE = 9;
+const int MAX_FNAME_SIZE = 255;
 
-// Maximum number of files in a directory
-const int MAX_DIR_ENTRIES = ((BLOCK_SIZE - 8) / 12);
+// Maximum number of continuation blocks in a directory
+const int MAX_DIR_BLOCKS = 16;
 
-// Maximum number of blocks in a data file
-const int MAX_DATA_BLOCKS = ((BLOCK_SIZE - 8) / 2);
+// Bytes of directory records held in the directory block itself, and in
+// each continuation block after its magic number
+const int DIR_INLINE_SIZE = (BLOCK_SIZE - 8 - MAX_DIR_BLOCKS * 2);
+const int DIR_DATA_SIZE = (BLOCK_SIZE - 4);
+
+// Maximum bytes of records in a directory
+const int MAX_DIR_SIZE = (DIR_INLINE_SIZE + MAX_DIR_BLOCKS * DIR_DATA_SIZE);
+
+// Maximum number of blocks in a data file - set so a block map holds
+// one index per block after its magic number
+const int MAX_DATA_BLOCKS = ((BLOCK_SIZE - 4) / 2);
 
 // Maximum file size for a data file
 const int MAX_FILE_SIZE = (MAX_DATA_BLOCKS * BLOCK_SIZE);
 
-// Magic numbers - used to distinguish between directory blocks and inodes
+// Size of a fragment - file tails are packed into fragment blocks in
+// units of this size
+const int FRAGMENT_SIZE = 8;
+
+// Number of fragments in a fragment block - set so the fragments and
+// their bitmap fit after the magic number
+const int NUM_FRAGMENTS = (((BLOCK_SIZE - 4) * 8) / (FRAGMENT_SIZE * 8 + 1));
+
+// Maximum size of a file tail that can be packed into a fragment block
+const int MAX_TAIL_SIZE = (NUM_FRAGMENTS * FRAGMENT_SIZE);
+
+// Number of blocks in a block group - the allocator keeps related blocks
+// within the group of their parent directory, and each group's part of the
+// superblock bitmap is a separate run of bytes
+const int BLOCKS_PER_GROUP = 128;
+const int NUM_GROUPS = ((NUM_BLOCKS + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP);
+
+// Size of an inode in the inode table
+const int INODE_SIZE = 16;
+
+// Number of inodes packed into an inode table block
+const int INODES_PER_BLOCK = ((BLOCK_SIZE - 4) / INODE_SIZE);
+
+// Number of inode table blocks at the start of each block group (after the
+// superblock and root directory in the first group), and the inodes they hold
+const int INODE_BLOCKS_PER_GROUP = 8;
+const int INODES_PER_GROUP = (INODE_BLOCKS_PER_GROUP * INODES_PER_BLOCK);
+const int NUM_INODES = (NUM_GROUPS * INODES_PER_GROUP);
+
+// Value of in_use for an inode whose file was removed from its directory
+// but whose data blocks have not all been reclaimed yet
+const unsigned char INODE_ORPHAN = 2;
+
+// Magic numbers - used to distinguish between directory blocks, inode
+// table blocks, fragment blocks, block maps and directory continuation blocks
 const unsigned int DIR_MAGIC_NUM = 0xFFFFFFFF;
 const unsigned int INODE_MAGIC_NUM = 0xFFFFFFFE;
+const unsigned int FRAG_MAGIC_NUM = 0xFFFFFFFD;
+const unsigned int MAP_MAGIC_NUM = 0xFFFFFFFC;
+const unsigned int DIR_DATA_MAGIC_NUM = 0xFFFFFFFB;
 
 // BLOCK TYPES
 
@@ -36,30 +82,101 @@ struct superblock_t
 	unsigned char bitmap[BLOCK_SIZE]; // bitmap of free blocks
 };
 
-// Directory block - represents a directory
+// Directory record header - each record in a directory is this header
+// followed by name_len bytes of name, with no null and no padding. Records
+// are packed end to end and may straddle block boundaries.
+struct direntry_t
+{
+	unsigned int hash;		// hash of the name, compared before the name itself
+	short block_num;		// block number of a directory, or NUM_BLOCKS + inode number of a data file
+	unsigned char name_len;		// length of the name in bytes
+	unsigned char reserved;		// unused
+};
+
+// Directory block - represents a directory. The first DIR_INLINE_SIZE bytes
+// of its records are held here, the rest in continuation blocks.
 struct dirblock_t
 {
 	unsigned int magic;		// magic number, must be DIR_MAGIC_NUM
-	unsigned int num_entries;	// number of files in directory
-	struct
-	{
-		char name[MAX_FNAME_SIZE + 1]; // file name (extra space for null)
-		short block_num;		   // block number of file (0 - unused)
-	} dir_entries[MAX_DIR_ENTRIES];  // list of directory entries
+	unsigned short num_entries;	// number of files in directory
+	unsigned short length;		// bytes of records in the directory
+	short blocks[MAX_DIR_BLOCKS];	// continuation blocks holding the records past the first DIR_INLINE_SIZE bytes (0 - unused)
+	char records[DIR_INLINE_SIZE];	// first bytes of the records
 };
 
-// Inode - index node for a data file
-struct inode_t
+// Directory continuation block - holds more records of a directory
+struct dirdatablock_t
+{
+	unsigned int magic;		// magic number, must be DIR_DATA_MAGIC_NUM
+	char records[DIR_DATA_SIZE];	// records continuing from the previous block
+};
+
+// Inode table entry - fixed-size index node for a data file
+struct dinode_t
+{
+	unsigned int size;		 // file size in bytes
+	unsigned char in_use;		 // 1 if the inode belongs to a file, INODE_ORPHAN while a removed file's blocks are reclaimed
+	unsigned char tail_offset;	 // byte offset of the tail in the fragment block, its length is size % BLOCK_SIZE
+	unsigned short reserved;	 // number of preallocated blocks past the end of the file
+	short tail_block;		 // fragment block holding the last partial block (0 - not packed)
+	short map_block;		 // block map listing the data blocks (0 - no data blocks yet)
+	unsigned int generation;	 // bumped on every change to the file, carries on when the inode is reused
+};
+
+// Inode table block - packs several inodes, addressed by inode number
+struct inodeblock_t
 {
 	unsigned int magic;		 // magic number, must be INODE_MAGIC_NUM
+	dinode_t inodes[INODES_PER_BLOCK];	// inode table entries
+	char unused[BLOCK_SIZE - 4 - INODES_PER_BLOCK * INODE_SIZE];	// pads the block out to BLOCK_SIZE
+};
+
+// Block map - lists the data blocks of a file
+struct mapblock_t
+{
+	unsigned int magic;		 // magic number, must be MAP_MAGIC_NUM
+	short blocks[MAX_DATA_BLOCKS]; // array of direct indices to data blocks
+};
+
+// Inode - a data file's inode table entry with its block map filled in,
+// as read and written by BasicFileSys
+struct inode_t
+{
 	unsigned int size;		 // file size in bytes
+	unsigned short reserved;	 // number of preallocated blocks past the end of the file
+	short tail_block;		 // fragment block holding the last partial block (0 - not packed)
+	unsigned short tail_offset;	 // byte offset of the tail in the fragment block, its length is size % BLOCK_SIZE
+	short map_block;		 // block map listing the data blocks (0 - no data blocks yet)
+	unsigned int generation;	 // bumped on every change to the file
 	short blocks[MAX_DATA_BLOCKS]; // array of direct indices to data blocks
 };
 
+// Fragment block - stores the tails of several files
+struct fragblock_t
+{
+	unsigned int magic;		 // magic number, must be FRAG_MAGIC_NUM
+	unsigned char bitmap[(NUM_FRAGMENTS + 7) / 8];	// bitmap of used fragments
+	char data[NUM_FRAGMENTS * FRAGMENT_SIZE];	// fragments (FRAGMENT_SIZE bytes each)
+	char unused[BLOCK_SIZE - 4 - (NUM_FRAGMENTS + 7) / 8 - NUM_FRAGMENTS * FRAGMENT_SIZE];	// pads the block out to BLOCK_SIZE
+};
+
 // Data block - stores data for a data file
 struct datablock_t
 {
 	char data[BLOCK_SIZE];	// data (BLOCK_SIZE bytes)
 };
 
+// Blocks are read and written BLOCK_SIZE bytes at a time straight into
+// these structs, so each must be exactly one block
+static_assert(sizeof(superblock_t) == BLOCK_SIZE, "superblock_t must fill a block");
+static_assert(sizeof(dirblock_t) == BLOCK_SIZE, "dirblock_t must fill a block");
+static_assert(sizeof(dirdatablock_t) == BLOCK_SIZE, "dirdatablock_t must fill a block");
+static_assert(sizeof(inodeblock_t) == BLOCK_SIZE, "inodeblock_t must fill a block");
+static_assert(sizeof(mapblock_t) == BLOCK_SIZE, "mapblock_t must fill a block");
+static_assert(sizeof(fragblock_t) == BLOCK_SIZE, "fragblock_t must fill a block");
+static_assert(sizeof(datablock_t) == BLOCK_SIZE, "datablock_t must fill a block");
+
+// Inode tables hold INODES_PER_BLOCK entries of INODE_SIZE bytes each
+static_assert(sizeof(dinode_t) == INODE_SIZE, "dinode_t must be INODE_SIZE bytes");
+
 #endif
@@ -2,65 +2,263 @@
 // This implements a simulated disk consisting of an array of blocks.
 
 #include <cstdint>  // intmax_t
-#include <cstdlib>
-#include <iostream>  // cerr, endl
+#include <cstdlib>  // exit, posix_memalign, malloc, free
+#include <cstring>  // memcpy, memset, strerror
+#include <cerrno>  // errno
+#include <iostream>  // cerr, cout, endl
+
+#include <fcntl.h>  // open, O_RDWR, O_RDONLY, O_CREAT, O_EXCL, O_DIRECT
 
 #include "Disk.h"
 #include "Blocks.h"
 
 
+#if _WIN32
+#include <io.h>  // _open, _close, _lseeki64, _read, _write, _commit
+#include <malloc.h>  // _aligned_malloc, _aligned_free
+
+
 namespace
 {
 	using ssize_t = std::intmax_t;
+
+
+	int open(const char* a_fileName, int a_flags, int a_mode)
+	{
+		return _open(a_fileName, a_flags | _O_BINARY, a_mode);
+	}
+
+
+	int close(int a_fd)
+	{
+		return _close(a_fd);
+	}
+
+
+	ssize_t pread(int a_fd, void* a_buf, std::size_t a_count, std::intmax_t a_offset)
+	{
+		if (_lseeki64(a_fd, a_offset, SEEK_SET) != a_offset) {
+			return -1;
+		}
+		return _read(a_fd, a_buf, static_cast<unsigned int>(a_count));
+	}
+
+
+	ssize_t pwrite(int a_fd, const void* a_buf, std::size_t a_count, std::intmax_t a_offset)
+	{
+		if (_lseeki64(a_fd, a_offset, SEEK_SET) != a_offset) {
+			return -1;
+		}
+		return _write(a_fd, a_buf, static_cast<unsigned int>(a_count));
+	}
+
+
+	int fsync(int a_fd)
+	{
+		return _commit(a_fd);
+	}
+}
+#else
+#include <sys/mman.h>  // mmap, munmap
+#include <unistd.h>  // close, pread, pwrite, fsync
+#endif
+
+
+namespace
+{
+	// Allocates a_size bytes aligned to a_alignment, returns 0 on failure.
+	void* allocate_aligned(std::size_t a_size, std::size_t a_alignment)
+	{
+#if _WIN32
+		return _aligned_malloc(a_size, a_alignment);
+#else
+		void* mem = 0;
+		return posix_memalign(&mem, a_alignment, a_size) == 0 ? mem : 0;
+#endif
+	}
+
+
+	// Frees memory returned by allocate_aligned.
+	void free_aligned(void* a_mem)
+	{
+#if _WIN32
+		_aligned_free(a_mem);
+#else
+		std::free(a_mem);
+#endif
+	}
+
+
+	// Maps the first a_size bytes of the file read-only, returns 0 on
+	// failure. Without mmap the bytes are read into memory instead.
+	char* map_file(int a_fd, std::size_t a_size)
+	{
+#if _WIN32
+		char* mem = static_cast<char*>(std::malloc(a_size));
+		if (mem && pread(a_fd, mem, a_size, 0) != static_cast<ssize_t>(a_size)) {
+			std::free(mem);
+			mem = 0;
+		}
+		return mem;
+#else
+		void* mem = mmap(0, a_size, PROT_READ, MAP_SHARED, a_fd, 0);
+		return mem == MAP_FAILED ? 0 : static_cast<char*>(mem);
+#endif
+	}
+
+
+	// Releases a mapping made by map_file.
+	void unmap_file(char* a_mem, std::size_t a_size)
+	{
+#if _WIN32
+		(void)a_size;
+		std::free(a_mem);
+#else
+		munmap(a_mem, a_size);
+#endif
+	}
+
+
+	// Size of the disk file
+	const std::size_t DISK_SIZE = static_cast<std::size_t>(NUM_BLOCKS) * BLOCK_SIZE;
+}
+
+
+Disk::Disk() :
+	_fd(-1),
+	_direct(false),
+	_map(nullptr),
+	_buffers()
+{}
+
+
+Disk::~Disk()
+{
+	for (char *buf : _buffers) {
+		free_aligned(buf);
+	}
 }
 
 
 // Opens the file "file_name" that represents the disk.  If the file does
 // not exist, file is created. Returns true if a file is created and false if
 // the file parameter fd exists. Any other error aborts the program.
-bool Disk::mount(const char* file_name)
-{
-	_file.open(file_name, std::ios_base::in | std::ios_base::out);
-	if (!_file.is_open()) {
-		_file.open(file_name, std::ios_base::app);
-		_file.close();
-		_file.open(file_name, std::ios_base::in | std::ios_base::out);
-		if (!_file.is_open()) {
+// If direct is set, reads and writes bypass the kernel page cache when the
+// file system supports it.
+bool Disk::mount(const char* file_name, bool direct)
+{
+	bool created = false;
+	_fd = open(file_name, O_RDWR, 0);
+	if (_fd < 0) {
+		_fd = open(file_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+		if (_fd < 0) {
 			std::cerr << "Could not create disk" << std::endl;
 			exit(-1);
 		}
+		created = true;
+	}
+
+	// reopen without the page cache, keeping the buffered file if that fails
+	_direct = false;
+	if (direct) {
+#ifdef O_DIRECT
+		int fd = open(file_name, O_RDWR | O_DIRECT, 0);
+		if (fd >= 0) {
+			close(_fd);
+			_fd = fd;
+			_direct = true;
+		} else {
+			std::cerr << "Direct I/O unavailable (" << std::strerror(errno) << "), using the page cache" << std::endl;
+		}
+#else
+		std::cerr << "Direct I/O unavailable on this system, using the page cache" << std::endl;
+#endif
 	}
 
-	return true;
+	return created;
+}
+
+
+// Opens the existing file "file_name" for reading only and maps it into
+// memory, shared with every other process mapping it. Blocks are then
+// read straight from the mapping and the disk cannot be written. A
+// missing or short file aborts the program.
+void Disk::mount_read_only(const char* file_name)
+{
+	_fd = open(file_name, O_RDONLY, 0);
+	if (_fd < 0) {
+		std::cerr << "Could not open disk for reading" << std::endl;
+		exit(-1);
+	}
+	_direct = false;
+
+	// a disk that was never fully formatted cannot be mapped whole
+	char last[BLOCK_SIZE];
+	if (pread(_fd, last, BLOCK_SIZE, static_cast<std::intmax_t>(DISK_SIZE - BLOCK_SIZE)) != BLOCK_SIZE) {
+		std::cerr << "Disk is too short to map" << std::endl;
+		exit(-1);
+	}
+	_map = map_file(_fd, DISK_SIZE);
+	if (!_map) {
+		std::cerr << "Could not map disk" << std::endl;
+		exit(-1);
+	}
 }
 
 
 // Closes the file descriptor that represents the disk.
 void Disk::unmount()
 {
-	_file.close();
+	if (_map) {
+		unmap_file(_map, DISK_SIZE);
+		_map = nullptr;
+	}
+	close(_fd);
+	_fd = -1;
+	_direct = false;
+}
+
+
+// Returns true if reads and writes bypass the kernel page cache.
+bool Disk::direct() const
+{
+	return _direct;
+}
+
+
+// Returns the bytes of block block_num in the mapped file of a read-only
+// disk, or nullptr if the disk is not mapped.
+const char *Disk::mapped_block(int block_num) const
+{
+	if (!_map || block_num < 0 || block_num >= NUM_BLOCKS) {
+		return nullptr;
+	}
+	return _map + static_cast<std::size_t>(block_num) * BLOCK_SIZE;
 }
 
 
 // Reads disk block block_num from the disk into block.
 void Disk::read_block(int block_num, void *block)
 {
-	off_t offset;
-
 	if (block_num < 0 || block_num >= NUM_BLOCKS) {
 		std::cerr << "Invalid block size" << std::endl;
 		exit(-1);
 	}
 
-	offset = block_num * BLOCK_SIZE;
-	_file.seekp(offset);
-	if (!_file.good()) {
-		std::cerr << "Seek failure" << std::endl;
-		exit(-1);
+	if (_map) {
+		std::memcpy(block, mapped_block(block_num), BLOCK_SIZE);
+		return;
 	}
 
-	_file.read(reinterpret_cast<char*>(block), BLOCK_SIZE);
-	if (!_file.good()) {
+	if (_direct) {
+		char *buf = acquire_buffer();
+		read_unit(block_num / BLOCKS_PER_IO_UNIT, buf);
+		std::memcpy(block, buf + (block_num % BLOCKS_PER_IO_UNIT) * BLOCK_SIZE, BLOCK_SIZE);
+		release_buffer(buf);
+		return;
+	}
+
+	if (pread(_fd, block, BLOCK_SIZE, static_cast<std::intmax_t>(block_num) * BLOCK_SIZE) != BLOCK_SIZE) {
 		std::cerr << "Failed to read entire block" << std::endl;
 		exit(-1);
 	}
@@ -68,26 +266,133 @@ void Disk::read_block(int block_num, void *block)
 
 
 // Writes the data in block to disk block block_num.
-void Disk::write_block(int block_num, void *block)
+void Disk::write_block(int block_num, const void *block)
 {
-	off_t offset;
-
 	if (block_num < 0 || block_num >= NUM_BLOCKS) {
 		std::cerr << "Invalid block size" << std::endl;
 		exit(-1);
 	}
 
-	offset = block_num * BLOCK_SIZE;
-	_file.seekp(offset);
-	if (!_file.good()) {
-		std::cerr << "Seek failure" << std::endl;
+	if (_map) {
+		std::cerr << "Disk is read-only" << std::endl;
+		exit(-1);
+	}
+
+	if (_direct) {
+		std::vector<BlockWrite> writes(1);
+		writes[0].block_num = block_num;
+		writes[0].block = block;
+		write_blocks(writes);
+		return;
+	}
+
+	if (pwrite(_fd, block, BLOCK_SIZE, static_cast<std::intmax_t>(block_num) * BLOCK_SIZE) != BLOCK_SIZE) {
+		std::cerr << "Failed to write entire block" << std::endl;
+		exit(-1);
+	}
+}
+
+
+// Writes every block in writes, which must be sorted by block number.
+// Without the page cache, blocks sharing an I/O unit are written together.
+void Disk::write_blocks(const std::vector<BlockWrite> &writes)
+{
+	if (!_direct || _map) {
+		for (const BlockWrite &write : writes) {
+			write_block(write.block_num, write.block);
+		}
+		return;
+	}
+
+	char *buf = acquire_buffer();
+	std::size_t i = 0;
+	while (i < writes.size()) {
+		int unit = writes[i].block_num / BLOCKS_PER_IO_UNIT;
+		std::size_t end = i;
+		std::vector<bool> covered(BLOCKS_PER_IO_UNIT, false);
+		int numCovered = 0;
+		for (; end < writes.size() && writes[end].block_num / BLOCKS_PER_IO_UNIT == unit; end++) {
+			if (writes[end].block_num < 0 || writes[end].block_num >= NUM_BLOCKS) {
+				std::cerr << "Invalid block size" << std::endl;
+				exit(-1);
+			}
+			int slot = writes[end].block_num % BLOCKS_PER_IO_UNIT;
+			if (!covered[slot]) {
+				covered[slot] = true;
+				numCovered++;
+			}
+		}
+
+		// only blocks the batch leaves untouched need reading first
+		if (numCovered < BLOCKS_PER_IO_UNIT) {
+			read_unit(unit, buf);
+		}
+		for (; i < end; i++) {
+			std::memcpy(buf + (writes[i].block_num % BLOCKS_PER_IO_UNIT) * BLOCK_SIZE, writes[i].block, BLOCK_SIZE);
+		}
+		write_unit(unit, buf);
+	}
+	release_buffer(buf);
+}
+
+
+// Waits until every block written so far is stored on the device.
+void Disk::sync()
+{
+	if (fsync(_fd) != 0) {
+		std::cerr << "Failed to sync disk" << std::endl;
+		exit(-1);
+	}
+}
+
+
+// Takes an aligned I/O unit buffer from the pool.
+char *Disk::acquire_buffer()
+{
+	if (!_buffers.empty()) {
+		char *buf = _buffers.back();
+		_buffers.pop_back();
+		return buf;
+	}
+
+	char *buf = static_cast<char *>(allocate_aligned(DIRECT_IO_SIZE, DIRECT_IO_SIZE));
+	if (!buf) {
+		std::cerr << "Could not allocate I/O buffer" << std::endl;
 		exit(-1);
 	}
+	return buf;
+}
+
+
+// Returns a buffer to the pool.
+void Disk::release_buffer(char *a_buf)
+{
+	if (_buffers.size() < DIRECT_IO_BUFFERS) {
+		_buffers.push_back(a_buf);
+	} else {
+		free_aligned(a_buf);
+	}
+}
+
 
-	_file.write(reinterpret_cast<char*>(block), BLOCK_SIZE);
-	_file.flush();
-	if (!_file.good()) {
+// Reads an I/O unit. The part past the end of the file reads as zeros,
+// which happens while a new disk is being formatted.
+void Disk::read_unit(int a_unit, char *a_buf)
+{
+	ssize_t result = pread(_fd, a_buf, DIRECT_IO_SIZE, static_cast<std::intmax_t>(a_unit) * DIRECT_IO_SIZE);
+	if (result < 0) {
 		std::cerr << "Failed to read entire block" << std::endl;
 		exit(-1);
 	}
+	std::memset(a_buf + result, 0, DIRECT_IO_SIZE - result);
+}
+
+
+// Writes an I/O unit.
+void Disk::write_unit(int a_unit, const char *a_buf)
+{
+	if (pwrite(_fd, a_buf, DIRECT_IO_SIZE, static_cast<std::intmax_t>(a_unit) * DIRECT_IO_SIZE) != DIRECT_IO_SIZE) {
+		std::cerr << "Failed to write entire block" << std::endl;
+		exit(-1);
+	}
 }
@@ -4,27 +4,79 @@
 #ifndef DISK_H
 #define DISK_H
 
-#include <fstream>  // fstream
+#include <vector>  // vector
+
+#include "Blocks.h"
+
+// Size and alignment of one transfer when the disk bypasses the page cache.
+// Blocks are smaller than a sector, so they are read and written in whole
+// units of this many bytes.
+const int DIRECT_IO_SIZE = 4096;
+const int BLOCKS_PER_IO_UNIT = (DIRECT_IO_SIZE / BLOCK_SIZE);
+
+// Number of aligned transfer buffers kept for reuse
+const int DIRECT_IO_BUFFERS = 4;
+
+// One block to be written by Disk::write_blocks
+struct BlockWrite
+{
+	int block_num;
+	const void *block;
+};
 
 class Disk
 {
 public:
+	Disk();
+	~Disk();
+
 	// Opens the file "file_name" that represents the disk.  If the file does
 	// not exist, file is created. Returns true if a file is created and false if
 	// the file parameter fd exists. Any other error aborts the program.
-	bool mount(const char *filename);
+	// If direct is set, reads and writes bypass the kernel page cache when the
+	// file system supports it.
+	bool mount(const char *filename, bool direct = false);
+
+	// Opens the existing file "file_name" for reading only and maps it into
+	// memory, shared with every other process mapping it. Blocks are then
+	// read straight from the mapping and the disk cannot be written. A
+	// missing or short file aborts the program.
+	void mount_read_only(const char *filename);
 
 	// Closes the file descriptor that represents the disk.
 	void unmount();
 
+	// Returns true if reads and writes bypass the kernel page cache.
+	bool direct() const;
+
+	// Returns the bytes of block block_num in the mapped file of a read-only
+	// disk, or nullptr if the disk is not mapped.
+	const char *mapped_block(int block_num) const;
+
 	// Reads disk block block_num from the disk into block.
 	void read_block(int block_num, void *block);
 
 	// Writes the data in block to disk block block_num.
-	void write_block(int block_num, void *block);
+	void write_block(int block_num, const void *block);
+
+	// Writes every block in writes, which must be sorted by block number.
+	// Without the page cache, blocks sharing an I/O unit are written together.
+	void write_blocks(const std::vector<BlockWrite> &writes);
+
+	// Waits until every block written so far is stored on the device.
+	void sync();
 
 private:
-	std::fstream _file;
+	char *acquire_buffer();	// takes an aligned I/O unit buffer from the pool
+	void release_buffer(char *a_buf);	// returns a buffer to the pool
+	void read_unit(int a_unit, char *a_buf);	// reads an I/O unit, past the end of the file reads zeros
+	void write_unit(int a_unit, const char *a_buf);	// writes an I/O unit
+
+
+	int _fd;
+	bool _direct;	// true if the file was opened with O_DIRECT
+	char *_map;	// the whole file mapped read-only, or nullptr
+	std::vector<char *> _buffers;	// free aligned I/O unit buffers
 };
 
 #endif
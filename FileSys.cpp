@@ -3,8 +3,10 @@
 
 #include "FileSys.h"
 
+#include <algorithm>  // all_of, find, max, min
+#include <cstddef>  // offsetof
 #include <cstdlib>  // size_t
-#include <cstring>  // strlen, strcmp, strcpy, memset
+#include <cstring>  // strlen, memcmp, memset, memcpy
 #include <iostream>  // cerr, endl
 #include <ostream>  // basic_ostream
 #include <stdexcept>  // runtime_error
@@ -37,7 +39,7 @@ public:
 	explicit bad_block_alloc(const char* a_fileName) :
 		std::runtime_error("")
 	{
-		_what = "Disk is full when attempting to append data to file with name \"";
+		_what = "Disk is full when attempting to allocate blocks for file with name \"";
 		_what += a_fileName;
 		_what += "\"!";
 	}
@@ -54,17 +56,29 @@ private:
 
 
 FileSys::FileSys() :
+	_delayedWrites(),
+	_delayedBytes(0),
+	_fragHint(kInvalidHandle),
+	_recordIndexes(),
 	_curDirHandle(kInvalidHandle),
+	_txnDirHandle(kInvalidHandle),
+	_txnFailed(false),
 	_fsSock(INVALID_SOCKET),
 	_lastErr(FileError::kOK),
+	_flushErr(FileError::kOK),
 	_response("")
 {}
 
 
 // mounts the file system
-void FileSys::mount(socket_t a_sock)
+void FileSys::mount(socket_t a_sock, const MountOptions& a_options)
 {
-	_bfs.mount();
+	_bfs.mount(a_options);
+	std::cout << "Block cache arena huge pages: " << _bfs.get_cache().huge_pages() << std::endl;
+	std::cout << "Disk I/O: " << (_bfs.direct_io() ? "direct" : "buffered") << std::endl;
+	std::cout << "Allocation: " << (_bfs.next_fit() ? "next-fit" : "by block group") << std::endl;
+	std::cout << "Removed files: " << (_bfs.deferred_free() ? "freed in the background" : "freed right away") << std::endl;
+	std::cout << "Access: " << (_bfs.read_only() ? "read-only, mapped" : "read-write") << std::endl;
 	_curDirHandle = kRootDirHandle; //by default current directory is home directory, in disk block #1
 	_fsSock = a_sock; //use this socket to receive file system operations from the client and send back response messages
 }
@@ -73,6 +87,11 @@ void FileSys::mount(socket_t a_sock)
 // unmounts the file system
 void FileSys::unmount()
 {
+	if (_bfs.in_transaction()) {	// a transaction left open is dropped
+		RollBackTransaction();
+	}
+	FlushDelayedWrites();
+	_recordIndexes.clear();
 	_bfs.unmount();
 	close(_fsSock);
 }
@@ -81,6 +100,10 @@ void FileSys::unmount()
 // make a directory
 void FileSys::mkdir(const char* a_name)
 {
+	if (!Writable()) {
+		return;
+	}
+
 	MakeBlock<dirblock_t>(a_name);
 }
 
@@ -88,20 +111,19 @@ void FileSys::mkdir(const char* a_name)
 // switch to a directory
 void FileSys::cd(const char* a_name)
 {
-	auto curDir = ReadDirBlock(_curDirHandle);
+	auto curDir = ReadDirectory(_curDirHandle);
 	if (!curDir.second) {
 		return;
 	}
 
-	DirEntry* entry = ForEachDirEntry(curDir.first, [a_name](DirEntry& a_entry) -> bool
-	{
-		return a_entry.block_num != kInvalidHandle && std::strcmp(a_entry.name, a_name) == 0;
-	});
-
-	if (entry) {
-		_curDirHandle = entry->block_num;
-	} else {
+	DirEntry entry;
+	if (!FindDirEntry(curDir.first, a_name, entry)) {
 		PrintFailedToFindFile(a_name);
+	} else if (IsINodeHandle(entry.block_num)) {
+		std::cerr << "File with name \"" << a_name << "\" is not a directory!" << std::endl;
+		_lastErr = FileError::kFileNotDir;
+	} else {
+		_curDirHandle = entry.block_num;
 	}
 }
 
@@ -116,29 +138,28 @@ void FileSys::home()
 // remove a directory
 void FileSys::rmdir(const char* a_name)
 {
-	auto curDir = ReadDirBlock(_curDirHandle);
-	if (!curDir.second) {
+	if (!Writable()) {
 		return;
 	}
 
-	DirEntry* entry = ForEachDirEntry(curDir.first, [a_name](DirEntry& a_entry) -> bool
-	{
-		return a_entry.block_num != kInvalidHandle && std::strcmp(a_entry.name, a_name) == 0;
-	});
+	auto curDir = ReadDirectory(_curDirHandle);
+	if (!curDir.second) {
+		return;
+	}
 
-	if (entry) {
-		auto rmDir = ReadDirBlock(entry->block_num);
+	DirEntry entry;
+	if (FindDirEntry(curDir.first, a_name, entry)) {
+		auto rmDir = ReadDirectory(entry.block_num);
 		if (!rmDir.second) {
 			std::cerr << "File with name \"" << a_name << "\" is not a directory!" << std::endl;
 			_lastErr = FileError::kFileNotDir;
 			return;
 		}
 
-		if (rmDir.first.num_entries == 0) {
-			_bfs.reclaim_block(entry->block_num);
-			entry->block_num = kInvalidHandle;
-			--curDir.first.num_entries;
-			_bfs.write_block(_curDirHandle, &curDir.first);
+		if (rmDir.first.block.num_entries == 0) {
+			_bfs.reclaim_block(entry.block_num);
+			RemoveFromDirectory(curDir.first, entry);
+			WriteDirectory(_curDirHandle, curDir.first, entry.offset);
 		} else {
 			std::cerr << "Directory with name \"" << a_name << "\" is not empty!" << std::endl;
 			_lastErr = FileError::kDirNotEmpty;
@@ -152,22 +173,19 @@ void FileSys::rmdir(const char* a_name)
 // list the contents of current directory
 void FileSys::ls()
 {
-	auto curDir = ReadDirBlock(_curDirHandle);
+	auto curDir = ReadDirectory(_curDirHandle);
 	if (!curDir.second) {
 		return;
 	}
 
-	ForEachDirEntry(curDir.first, [this](DirEntry& a_entry) -> bool
+	DirEntry entry;
+	ForEachDirEntry(curDir.first, entry, [this](const DirEntry& a_entry) -> bool
 	{
-		static char buf[BLOCK_SIZE];
-		if (a_entry.block_num != kInvalidHandle) {
-			_response << a_entry.name;
-			_bfs.read_block(a_entry.block_num, &buf);
-			if (IsDirectory(buf)) {
-				_response << '/';
-			}
-			_response << '\n';
+		_response.write(a_entry.name, a_entry.name_len);
+		if (!IsINodeHandle(a_entry.block_num)) {
+			_response << '/';
 		}
+		_response << '\n';
 		return false;
 	});
 	_response << '\n';
@@ -177,6 +195,10 @@ void FileSys::ls()
 // create an empty data file
 void FileSys::create(const char* a_name)
 {
+	if (!Writable()) {
+		return;
+	}
+
 	MakeBlock<inode_t>(a_name);
 }
 
@@ -184,84 +206,143 @@ void FileSys::create(const char* a_name)
 // append data to a data file
 void FileSys::append(const char* a_name, const char* a_data)
 {
+	if (!Writable()) {
+		return;
+	}
+
 	if (*a_data == '\0') {
 		return;
 	}
 
-	auto curDir = ReadDirBlock(_curDirHandle);
-	if (!curDir.second) {
+	std::size_t offset;
+	AppendRecord(a_name, a_data, offset);
+}
+
+
+// append data to a data file as one whole record, and display the byte offset it starts at
+void FileSys::appendrec(const char* a_name, const char* a_data)
+{
+	if (!Writable()) {
 		return;
 	}
 
-	DirEntry* entry = ForEachDirEntry(curDir.first, [a_name](DirEntry& a_entry) -> bool
-	{
-		return a_entry.block_num != kInvalidHandle && std::strcmp(a_entry.name, a_name) == 0;
-	});
+	std::size_t offset;
+	if (AppendRecord(a_name, a_data, offset)) {
+		_response << offset << '\n';
+	}
+}
+
+
+// write data to a data file at a byte offset, leaving a hole past the old end
+void FileSys::write(const char* a_name, unsigned int a_offset, const char* a_data)
+{
+	if (!Writable()) {
+		return;
+	}
+
+	if (*a_data == '\0') {
+		return;
+	}
+
+	auto curDir = ReadDirectory(_curDirHandle);
+	if (!curDir.second) {
+		return;
+	}
 
-	if (entry) {
-		auto iNode = ReadINodeBlock(entry->block_num);
+	DirEntry entry;
+	if (FindDirEntry(curDir.first, a_name, entry)) {
+		FlushDelayedWrite(entry.block_num);
+		auto iNode = ReadINode(entry.block_num);
 		if (!iNode.second) {
 			return;
 		}
 
 		std::size_t dataLen = std::strlen(a_data);
-		if (dataLen > MAX_FILE_SIZE - iNode.first.size) {
+		if (a_offset > MAX_FILE_SIZE || dataLen > MAX_FILE_SIZE - a_offset) {
 			std::cerr << "Buffer overflow when attempting to write data to file with name \"" << a_name << "\"!" << std::endl;
 			_lastErr = FileError::kAppendExceedsMaxSize;
 			return;
 		}
 
-		// allocate new blocks
-		std::vector<BlockHandle> handles;
-		std::size_t freeCount = BLOCK_SIZE - iNode.first.size % BLOCK_SIZE;
-		std::size_t allocSize = dataLen > freeCount ? dataLen - freeCount : 0;
-		try {
-			std::size_t numAllocBlocks = allocSize / BLOCK_SIZE;	// full blocks
-			if (allocSize % BLOCK_SIZE != 0) {	// partial fill block
-				++numAllocBlocks;
-			}
-			if (iNode.first.blocks[iNode.first.size / BLOCK_SIZE] == kInvalidHandle) {	// current block
-				++numAllocBlocks;
-			}
+		_recordIndexes.erase(entry.block_num);	// records may have changed anywhere, the index is rebuilt when next needed
+		WriteData(entry.block_num, iNode.first, a_name, a_offset, a_data, dataLen);
+	} else {
+		PrintFailedToFindFile(a_name);
+	}
+}
 
-			while (numAllocBlocks--) {
-				handles.push_back(_bfs.get_free_block());
-				if (handles.back() == kInvalidHandle) {
-					throw bad_block_alloc(a_name);
-				}
-			}
-		} catch (bad_block_alloc& e) {
-			std::cerr << e.what() << std::endl;
-			_lastErr = FileError::kDiskFull;
-			for (auto& handle : handles) {
-				if (handle != kInvalidHandle) {
-					_bfs.reclaim_block(handle);
-				}
-			}
+
+// reserve blocks so a data file can grow to N bytes without further allocation
+void FileSys::prealloc(const char* a_name, unsigned int a_size)
+{
+	if (!Writable()) {
+		return;
+	}
+
+	auto curDir = ReadDirectory(_curDirHandle);
+	if (!curDir.second) {
+		return;
+	}
+
+	DirEntry entry;
+	if (FindDirEntry(curDir.first, a_name, entry)) {
+		FlushDelayedWrite(entry.block_num);
+		auto iNode = ReadINode(entry.block_num);
+		if (!iNode.second) {
 			return;
 		}
 
-		// assign block handles
-		for (std::size_t i = iNode.first.size / BLOCK_SIZE; i < MAX_DATA_BLOCKS && !handles.empty(); ++i) {
-			if (iNode.first.blocks[i] == kInvalidHandle) {
-				iNode.first.blocks[i] = handles.back();
-				handles.pop_back();
-			}
+		if (a_size > MAX_FILE_SIZE) {
+			std::cerr << "Buffer overflow when attempting to preallocate file with name \"" << a_name << "\"!" << std::endl;
+			_lastErr = FileError::kAppendExceedsMaxSize;
+			return;
 		}
 
-		// copy data
-		std::size_t dataIdx = 0;
-		while (dataIdx < dataLen) {
-			BlockHandle dataHandle = iNode.first.blocks[iNode.first.size / BLOCK_SIZE];
-			datablock_t dataBlock;
-			_bfs.read_block(dataHandle, &dataBlock);
-			for (int blockIdx = iNode.first.size % BLOCK_SIZE; blockIdx < BLOCK_SIZE && dataIdx < dataLen; ++blockIdx) {
-				dataBlock.data[blockIdx] = a_data[dataIdx++];
-				++iNode.first.size;
+		std::size_t firstIdx = CountBlocks(iNode.first.size) + iNode.first.reserved;
+		std::size_t lastIdx = CountBlocks(a_size);
+		if (lastIdx <= firstIdx) {
+			return;
+		}
+
+		if (!AssignBlockMap(entry.block_num, iNode.first, a_name)) {
+			return;
+		}
+
+		// prefer a single contiguous run, fall back to whatever blocks are free
+		std::vector<BlockHandle> handles;
+		std::size_t numAllocBlocks = lastIdx - firstIdx;
+		BlockHandle goal = DataGoal(entry.block_num, iNode.first, firstIdx);
+		BlockHandle extent = _bfs.get_free_extent(numAllocBlocks, goal);
+		if (extent != kInvalidHandle) {
+			for (std::size_t i = 0; i < numAllocBlocks; ++i) {
+				handles.push_back(extent + i);
+			}
+		} else {
+			try {
+				while (numAllocBlocks--) {
+					handles.push_back(_bfs.get_free_block(handles.empty() ? goal : handles.back() + 1));
+					if (handles.back() == kInvalidHandle) {
+						throw bad_block_alloc(a_name);
+					}
+				}
+			} catch (bad_block_alloc& e) {
+				std::cerr << e.what() << std::endl;
+				_lastErr = FileError::kDiskFull;
+				for (auto& handle : handles) {
+					if (handle != kInvalidHandle) {
+						_bfs.reclaim_block(handle);
+					}
+				}
+				WriteINode(entry.block_num, iNode.first);	// keeps the new block map
+				return;
 			}
-			_bfs.write_block(dataHandle, &dataBlock);
 		}
-		_bfs.write_block(entry->block_num, &iNode.first);
+
+		for (std::size_t i = 0; i < handles.size(); ++i) {
+			iNode.first.blocks[firstIdx + i] = handles[i];
+		}
+		iNode.first.reserved += handles.size();
+		WriteINode(entry.block_num, iNode.first);
 	} else {
 		PrintFailedToFindFile(a_name);
 	}
@@ -278,18 +359,15 @@ void FileSys::cat(const char* a_name)
 // display the first N bytes of the file
 void FileSys::head(const char* a_name, unsigned int a_size)
 {
-	auto curDir = ReadDirBlock(_curDirHandle);
+	auto curDir = ReadDirectory(_curDirHandle);
 	if (!curDir.second) {
 		return;
 	}
 
-	DirEntry* entry = ForEachDirEntry(curDir.first, [a_name](DirEntry& a_entry) -> bool
-	{
-		return a_entry.block_num != kInvalidHandle && std::strcmp(a_entry.name, a_name) == 0;
-	});
-
-	if (entry) {
-		auto iNode = ReadINodeBlock(entry->block_num);
+	DirEntry entry;
+	if (FindDirEntry(curDir.first, a_name, entry)) {
+		FlushDelayedWrite(entry.block_num);
+		auto iNode = ReadINode(entry.block_num);
 		if (!iNode.second) {
 			return;
 		}
@@ -298,17 +376,31 @@ void FileSys::head(const char* a_name, unsigned int a_size)
 			return;
 		}
 
-		std::size_t size = a_size < iNode.first.size ? a_size : iNode.first.size;
-		std::size_t numBlocks = size / BLOCK_SIZE + 1;
-		for (std::size_t i = 0; i < numBlocks; ++i) {
-			datablock_t dataBlock;
-			_bfs.read_block(iNode.first.blocks[i], &dataBlock);
-			if (i == numBlocks - 1) {
-				_response.write(dataBlock.data, size % BLOCK_SIZE);
-			} else {
-				_response.write(dataBlock.data, BLOCK_SIZE);
-			}
+		ReadData(iNode.first, 0, a_size);
+		_response << '\n';
+	} else {
+		PrintFailedToFindFile(a_name);
+	}
+}
+
+
+// display N bytes of the file starting at a byte offset
+void FileSys::read(const char* a_name, unsigned int a_offset, unsigned int a_size)
+{
+	auto curDir = ReadDirectory(_curDirHandle);
+	if (!curDir.second) {
+		return;
+	}
+
+	DirEntry entry;
+	if (FindDirEntry(curDir.first, a_name, entry)) {
+		FlushDelayedWrite(entry.block_num);
+		auto iNode = ReadINode(entry.block_num);
+		if (!iNode.second) {
+			return;
 		}
+
+		ReadData(iNode.first, a_offset, a_size);
 		_response << '\n';
 	} else {
 		PrintFailedToFindFile(a_name);
@@ -316,35 +408,69 @@ void FileSys::head(const char* a_name, unsigned int a_size)
 }
 
 
+// display N newline-terminated records of the file starting at a record number
+void FileSys::readrec(const char* a_name, unsigned int a_from, unsigned int a_count)
+{
+	BlockHandle handle;
+	if (!FindFile(a_name, handle)) {
+		return;
+	}
+
+	auto iNode = ReadINode(handle);
+	if (!iNode.second) {
+		return;
+	}
+
+	const RecordIndex& index = FindRecordIndex(handle, iNode.first);
+	if (a_from >= index.count || a_count == 0) {
+		return;
+	}
+
+	// only the blocks from the nearest indexed record on are read
+	std::size_t nearest = a_from / kRecordIndexStride;
+	std::size_t start = SkipRecords(iNode.first, index.starts[nearest], a_from - nearest * kRecordIndexStride);
+	std::size_t end = SkipRecords(iNode.first, start, a_count);
+	ReadData(iNode.first, start, end - start);
+	_response << '\n';
+}
+
+
 // delete a data file
 void FileSys::rm(const char* a_name)
 {
-	auto curDir = ReadDirBlock(_curDirHandle);
-	if (!curDir.second) {
+	if (!Writable()) {
 		return;
 	}
 
-	DirEntry* entry = ForEachDirEntry(curDir.first, [a_name](DirEntry& a_entry) -> bool
-	{
-		return a_entry.block_num != kInvalidHandle && std::strcmp(a_entry.name, a_name) == 0;
-	});
+	auto curDir = ReadDirectory(_curDirHandle);
+	if (!curDir.second) {
+		return;
+	}
 
-	if (entry) {
-		auto iNode = ReadINodeBlock(entry->block_num);
+	DirEntry entry;
+	if (FindDirEntry(curDir.first, a_name, entry)) {
+		auto iNode = ReadINode(entry.block_num);
 		if (!iNode.second) {
 			return;
 		}
 
-		if (iNode.first.size != 0) {
-			std::size_t numBlocks = iNode.first.size / MAX_DATA_BLOCKS + 1;
-			for (std::size_t i = 0; i < numBlocks; ++i) {
-				_bfs.reclaim_block(iNode.first.blocks[i]);
-			}
+		// data that never reached the disk needs no blocks reclaimed
+		DiscardDelayedWrite(entry.block_num);
+
+		// the tail's fragments are freed now; the data blocks, with any
+		// unused preallocation, and the block map go with the iNode, right
+		// away or in the background
+		if (iNode.first.tail_block != kInvalidHandle) {
+			datablock_t tail;
+			UnpackTail(iNode.first, tail);
 		}
-		_bfs.reclaim_block(entry->block_num);
-		entry->block_num = kInvalidHandle;
-		--curDir.first.num_entries;
-		_bfs.write_block(_curDirHandle, &curDir.first);
+		_bfs.orphan_inode(entry.block_num - kINodeHandleBase);
+		if (!_bfs.deferred_free()) {
+			_bfs.reclaim_orphans(NUM_BLOCKS);
+		}
+		_recordIndexes.erase(entry.block_num);
+		RemoveFromDirectory(curDir.first, entry);
+		WriteDirectory(_curDirHandle, curDir.first, entry.offset);
 	} else {
 		PrintFailedToFindFile(a_name);
 	}
@@ -354,28 +480,41 @@ void FileSys::rm(const char* a_name)
 // display stats about file or directory
 void FileSys::stat(const char* a_name)
 {
-	auto curDir = ReadDirBlock(_curDirHandle);
+	auto curDir = ReadDirectory(_curDirHandle);
 	if (!curDir.second) {
 		return;
 	}
 
-	DirEntry* entry = ForEachDirEntry(curDir.first, [a_name](DirEntry& a_entry) -> bool
-	{
-		return a_entry.block_num != kInvalidHandle && std::strcmp(a_entry.name, a_name) == 0;
-	});
-
-	if (entry) {
-		char buf[BLOCK_SIZE];
-		_bfs.read_block(entry->block_num, buf);
-		if (IsDirectory(buf)) {
-			_response << "Directory name: " << entry->name << '/' << '\n';
-			_response << "Directory block: " << entry->block_num << '\n';
+	DirEntry entry;
+	if (FindDirEntry(curDir.first, a_name, entry)) {
+		FlushDelayedWrite(entry.block_num);
+		if (!IsINodeHandle(entry.block_num)) {
+			_response << "Directory name: " << a_name << '/' << '\n';
+			_response << "Directory block: " << entry.block_num << '\n';
 		} else {
-			inode_t* iNode = reinterpret_cast<inode_t*>(buf);
-			_response << "iNode block: " << entry->block_num << '\n';
-			_response << "Bytes in files: " << iNode->size << '\n';
-			_response << "Number of blocks: " << (iNode->size == 0 ? 1 : iNode->size / BLOCK_SIZE + 2) << '\n';
-			_response << "First block: " << (iNode->size == 0 ? "N/A" : std::to_string(iNode->blocks[0])) << '\n';
+			auto iNode = ReadINode(entry.block_num);
+			if (!iNode.second) {
+				return;
+			}
+
+			std::size_t numBlocks = iNode.first.map_block != kInvalidHandle ? 1 : 0;
+			for (std::size_t i = 0; i < MAX_DATA_BLOCKS; ++i) {
+				if (iNode.first.blocks[i] != kInvalidHandle) {
+					++numBlocks;
+				}
+			}
+			int iNodeNum = entry.block_num - kINodeHandleBase;
+			BlockHandle firstBlock = iNode.first.blocks[0] != kInvalidHandle ? iNode.first.blocks[0] : iNode.first.tail_block;
+			_response << "iNode number: " << iNodeNum << '\n';
+			_response << "iNode block: " << _bfs.get_inode_block(iNodeNum) << '\n';
+			_response << "Bytes in files: " << iNode.first.size << '\n';
+			_response << "Generation: " << iNode.first.generation << '\n';
+			_response << "Number of blocks: " << numBlocks << '\n';
+			_response << "Reserved blocks: " << iNode.first.reserved << '\n';
+			_response << "First block: " << (firstBlock == kInvalidHandle ? "N/A" : std::to_string(firstBlock)) << '\n';
+			if (iNode.first.tail_block != kInvalidHandle) {
+				_response << "Tail fragment: block " << iNode.first.tail_block << ", offset " << iNode.first.tail_offset << '\n';
+			}
 		}
 	} else {
 		PrintFailedToFindFile(a_name);
@@ -383,6 +522,209 @@ void FileSys::stat(const char* a_name)
 }
 
 
+// display statistics about the block cache and free space
+void FileSys::stats()
+{
+	// a read-only mount reads the mapped disk directly and allocates nothing
+	if (_bfs.read_only()) {
+		_response << "Block cache: none, blocks are read from the mapped disk\n";
+		_response << "Free space: not tracked on a read-only mount\n";
+		return;
+	}
+
+	_bfs.get_cache().print_stats(_response);
+	const FreeMap& freeMap = _bfs.get_free_map();
+	_response << "Free runs: " << freeMap.run_count() << '\n';
+	_response << "Largest free run: " << freeMap.largest_run() << " blocks\n";
+	if (_bfs.deferred_free()) {
+		_response << "Blocks waiting to be freed: " << _bfs.orphan_block_count() << '\n';
+	}
+}
+
+
+// make the changes so far at least as durable as the given level
+void FileSys::commit(Durability a_level)
+{
+	switch (a_level) {
+	case Durability::kFlushed:
+		FlushDelayedWrites();
+		_bfs.flush();
+		break;
+	case Durability::kSynced:
+		FlushDelayedWrites();
+		_bfs.sync();
+		break;
+	case Durability::kNone:
+	default:
+		break;
+	}
+}
+
+
+// read part of the warm-up list into the block cache, returns true while
+// there is more to read
+bool FileSys::prefetch()
+{
+	return _bfs.prefetch();
+}
+
+
+// free a batch of the blocks of removed files, returns true while there
+// is more to free
+bool FileSys::reclaim()
+{
+	if (_bfs.in_transaction()) {	// the blocks are freed once the transaction is over
+		return false;
+	}
+	return _bfs.reclaim_orphans(RECLAIM_BATCH);
+}
+
+
+// append data to a data file if its generation is still a_generation, and
+// display its new generation
+void FileSys::appendIf(const char* a_name, unsigned int a_generation, const char* a_data)
+{
+	if (!Writable()) {
+		return;
+	}
+
+	BlockHandle handle;
+	if (!FindFile(a_name, handle)) {
+		return;
+	}
+
+	auto iNode = ReadINode(handle);
+	if (!iNode.second || !CheckGeneration(a_name, iNode.first, a_generation)) {
+		return;
+	}
+
+	// the data is written right away, so the generation shown covers it
+	std::size_t offset;
+	if (AppendRecord(a_name, a_data, offset)) {
+		FlushDelayedWrite(handle);
+		_response << ReadINode(handle).first.generation << '\n';
+	}
+}
+
+
+// write data to a data file at a byte offset if its generation is still
+// a_generation, and display its new generation
+void FileSys::writeIf(const char* a_name, unsigned int a_generation, unsigned int a_offset, const char* a_data)
+{
+	if (!Writable()) {
+		return;
+	}
+
+	BlockHandle handle;
+	if (!FindFile(a_name, handle)) {
+		return;
+	}
+
+	auto iNode = ReadINode(handle);
+	if (!iNode.second || !CheckGeneration(a_name, iNode.first, a_generation)) {
+		return;
+	}
+
+	write(a_name, a_offset, a_data);
+	if (_lastErr == FileError::kOK) {
+		_response << ReadINode(handle).first.generation << '\n';
+	}
+}
+
+
+// display the generation and contents of a data file, or nothing but
+// NOT_MODIFIED if its generation is still a_generation
+void FileSys::catIfChanged(const char* a_name, unsigned int a_generation)
+{
+	BlockHandle handle;
+	if (!FindFile(a_name, handle)) {
+		return;
+	}
+
+	auto iNode = ReadINode(handle);
+	if (!iNode.second) {
+		return;
+	}
+
+	if (iNode.first.generation == a_generation) {
+		_lastErr = FileError::kNotModified;
+		return;
+	}
+
+	_response << iNode.first.generation << '\n';
+	if (iNode.first.size != 0) {
+		ReadData(iNode.first, 0, MAX_FILE_SIZE);
+		_response << '\n';
+	}
+}
+
+
+// start a transaction, the commands after it take effect together when it
+// commits
+void FileSys::beginTransaction()
+{
+	if (!Writable()) {
+		return;
+	}
+
+	if (_bfs.in_transaction()) {
+		std::cerr << "A transaction is already open!" << std::endl;
+		_lastErr = FileError::kInTransaction;
+		return;
+	}
+
+	// data appended before the transaction is not part of it
+	FlushDelayedWrites();
+	_bfs.begin_transaction();
+	_txnDirHandle = _curDirHandle;
+	_txnFailed = false;
+}
+
+
+// apply the changes of the transaction all at once, or none of them if a
+// command in it failed
+void FileSys::commitTransaction()
+{
+	if (!Writable()) {
+		return;
+	}
+
+	if (!_bfs.in_transaction()) {
+		std::cerr << "No transaction is open!" << std::endl;
+		_lastErr = FileError::kNotInTransaction;
+		return;
+	}
+
+	if (!_txnFailed) {
+		FlushDelayedWrites();
+		_txnFailed = getFlushErr() != FileError::kOK;
+	}
+	if (_txnFailed) {
+		RollBackTransaction();
+		std::cerr << "Transaction rolled back after a command in it failed!" << std::endl;
+		_lastErr = FileError::kTransactionFailed;
+		return;
+	}
+	_bfs.commit_transaction();
+}
+
+
+// drop the changes of the transaction
+void FileSys::abortTransaction()
+{
+	if (!Writable()) {
+		return;
+	}
+
+	if (!_bfs.in_transaction()) {
+		std::cerr << "No transaction is open!" << std::endl;
+		_lastErr = FileError::kNotInTransaction;
+		return;
+	}
+	RollBackTransaction();
+}
+
+
 std::string FileSys::getQueryResponse() const
 {
 	std::string tmp = _response.str();
@@ -399,6 +741,19 @@ FileError FileSys::getLastErr() const noexcept
 {
 	auto tmp = _lastErr;
 	_lastErr = FileError::kOK;
+	// one failed command fails the whole transaction, but a stray begin or
+	// an unchanged file leaves it alone
+	if (tmp != FileError::kOK && tmp != FileError::kInTransaction && tmp != FileError::kNotModified && _bfs.in_transaction()) {
+		_txnFailed = true;
+	}
+	return tmp;
+}
+
+
+FileError FileSys::getFlushErr() noexcept
+{
+	auto tmp = _flushErr;
+	_flushErr = FileError::kOK;
 	return tmp;
 }
 
@@ -409,9 +764,15 @@ bool FileSys::IsDirectory(void* a_block) const
 }
 
 
-bool FileSys::IsINode(void* a_block) const
+bool FileSys::IsINodeHandle(BlockHandle a_handle) const
+{
+	return a_handle >= kINodeHandleBase;
+}
+
+
+bool FileSys::IsFragBlock(void* a_block) const
 {
-	return *reinterpret_cast<decltype(INODE_MAGIC_NUM)*>(a_block) == INODE_MAGIC_NUM;
+	return *reinterpret_cast<decltype(FRAG_MAGIC_NUM)*>(a_block) == FRAG_MAGIC_NUM;
 }
 
 
@@ -425,7 +786,13 @@ void FileSys::InitializeBlock(dirblock_t& a_block) const
 void FileSys::InitializeBlock(inode_t& a_block) const
 {
 	std::memset(&a_block, 0, sizeof(decltype(a_block)));
-	a_block.magic = INODE_MAGIC_NUM;
+}
+
+
+void FileSys::InitializeBlock(fragblock_t& a_block) const
+{
+	std::memset(&a_block, 0, sizeof(decltype(a_block)));
+	a_block.magic = FRAG_MAGIC_NUM;
 }
 
 
@@ -435,70 +802,783 @@ void FileSys::InitializeBlock(datablock_t& a_block) const
 }
 
 
-bool FileSys::InsertIntoDirectory(dirblock_t& a_dir, BlockHandle a_handle, const char* a_name)
+// directories spread out over the block groups
+FileSys::BlockHandle FileSys::AllocateHandle(const dirblock_t&)
 {
-	DirEntry* entry = ForEachDirEntry(a_dir, [a_name](DirEntry& a_entry) -> bool
-	{
-		return a_entry.block_num != kInvalidHandle && std::strcmp(a_entry.name, a_name) == 0;
-	});
+	return _bfs.get_free_block(_bfs.get_dir_goal(_curDirHandle));
+}
+
+
+// iNodes go in the block group of their directory
+FileSys::BlockHandle FileSys::AllocateHandle(const inode_t&)
+{
+	int iNodeNum = _bfs.get_free_inode(_curDirHandle);
+	return iNodeNum < 0 ? static_cast<BlockHandle>(kInvalidHandle) : static_cast<BlockHandle>(kINodeHandleBase + iNodeNum);
+}
+
+
+void FileSys::FreeHandle(BlockHandle a_handle)
+{
+	if (IsINodeHandle(a_handle)) {
+		_bfs.reclaim_inode(a_handle - kINodeHandleBase);
+	} else {
+		_bfs.reclaim_block(a_handle);
+	}
+}
+
+
+void FileSys::WriteNewBlock(BlockHandle a_handle, dirblock_t& a_block)
+{
+	_bfs.write_block(a_handle, &a_block);
+}
+
+
+void FileSys::WriteNewBlock(BlockHandle a_handle, inode_t& a_block)
+{
+	// a reused iNode carries on from the generation of its last file
+	a_block.generation = ReadINode(a_handle).first.generation;
+	WriteINode(a_handle, a_block);
+}
+
+
+// data goes right after the block before it in the file, or after the
+// block map or the iNode's table block
+FileSys::BlockHandle FileSys::DataGoal(BlockHandle a_handle, const inode_t& a_iNode, std::size_t a_idx) const
+{
+	while (a_idx-- > 0) {
+		if (a_iNode.blocks[a_idx] != kInvalidHandle) {
+			return a_iNode.blocks[a_idx] + 1;
+		}
+	}
+	if (a_iNode.map_block != kInvalidHandle) {
+		return a_iNode.map_block + 1;
+	}
+	return _bfs.get_inode_block(a_handle - kINodeHandleBase) + 1;
+}
+
+
+bool FileSys::FindFile(const char* a_name, BlockHandle& a_handle)
+{
+	auto curDir = ReadDirectory(_curDirHandle);
+	if (!curDir.second) {
+		return false;
+	}
+
+	DirEntry entry;
+	if (!FindDirEntry(curDir.first, a_name, entry)) {
+		PrintFailedToFindFile(a_name);
+		return false;
+	}
+	a_handle = entry.block_num;
+	FlushDelayedWrite(a_handle);
+	return true;
+}
+
+
+bool FileSys::CheckGeneration(const char* a_name, const inode_t& a_iNode, unsigned int a_generation)
+{
+	if (a_iNode.generation == a_generation) {
+		return true;
+	}
+	std::cerr << "File with name \"" << a_name << "\" is at generation " << a_iNode.generation << ", not " << a_generation << "!" << std::endl;
+	_lastErr = FileError::kGenerationMismatch;
+	_response << a_iNode.generation << '\n';
+	return false;
+}
+
+
+bool FileSys::AppendRecord(const char* a_name, const char* a_data, std::size_t& a_offset)
+{
+	auto curDir = ReadDirectory(_curDirHandle);
+	if (!curDir.second) {
+		return false;
+	}
+
+	DirEntry entry;
+	if (FindDirEntry(curDir.first, a_name, entry)) {
+		auto iNode = ReadINode(entry.block_num);
+		if (!iNode.second) {
+			return false;
+		}
+
+		// data appended earlier may still be waiting for its blocks
+		auto delayed = _delayedWrites.find(entry.block_num);
+		std::size_t delayedLen = delayed != _delayedWrites.end() ? delayed->second.data.size() : 0;
+		std::size_t delayedBlocks = delayed != _delayedWrites.end() ? delayed->second.numBlocks : 0;
+
+		// the record starts wherever the end of the file is once the data
+		// before it has been written
+		a_offset = iNode.first.size + delayedLen;
+		std::size_t dataLen = std::strlen(a_data);
+		if (dataLen == 0) {
+			return true;
+		}
+		if (dataLen > MAX_FILE_SIZE - iNode.first.size - delayedLen) {
+			std::cerr << "Buffer overflow when attempting to write data to file with name \"" << a_name << "\"!" << std::endl;
+			_lastErr = FileError::kAppendExceedsMaxSize;
+			return false;
+		}
+
+		// promise the blocks the data will need, but leave picking them to the flush
+		std::size_t numBlocks = CountUnassignedBlocks(iNode.first, iNode.first.size + delayedLen + dataLen);
+		if (numBlocks > delayedBlocks && !_bfs.reserve_blocks(numBlocks - delayedBlocks)) {
+			std::cerr << bad_block_alloc(a_name).what() << std::endl;
+			_lastErr = FileError::kDiskFull;
+			return false;
+		}
+
+		DelayedWrite& write = _delayedWrites[entry.block_num];
+		write.name = a_name;
+		write.data.append(a_data, dataLen);
+		write.numBlocks = numBlocks;
+		_delayedBytes += dataLen;
+
+		auto index = _recordIndexes.find(entry.block_num);
+		if (index != _recordIndexes.end()) {
+			IndexRecords(index->second, a_offset, a_data, dataLen);
+		}
+
+		if (write.data.size() >= kDelayedFlushSize) {
+			FlushDelayedWrite(entry.block_num);
+		} else if (_delayedBytes >= kDelayedFlushTotal) {
+			FlushDelayedWrites();
+		}
+		return true;
+	} else {
+		PrintFailedToFindFile(a_name);
+		return false;
+	}
+}
+
+
+// the block map is allocated along with the file's first data block
+bool FileSys::AssignBlockMap(BlockHandle a_handle, inode_t& a_iNode, const char* a_name)
+{
+	if (a_iNode.map_block != kInvalidHandle) {
+		return true;
+	}
+
+	a_iNode.map_block = _bfs.get_free_block(DataGoal(a_handle, a_iNode, 0));
+	if (a_iNode.map_block == kInvalidHandle) {
+		std::cerr << bad_block_alloc(a_name).what() << std::endl;
+		_lastErr = FileError::kDiskFull;
+		return false;
+	}
+	return true;
+}
+
 
-	if (entry) {
+bool FileSys::InsertIntoDirectory(Directory& a_dir, BlockHandle a_handle, const char* a_name)
+{
+	DirEntry entry;
+	if (FindDirEntry(a_dir, a_name, entry)) {
 		std::cerr << "File with name \"" << a_name << "\" already exists!" << std::endl;
 		_lastErr = FileError::kFileExists;
 		return false;
 	}
 
-	if (a_dir.num_entries >= MAX_DIR_ENTRIES) {
+	std::size_t nameLen = std::strlen(a_name);
+	if (nameLen > MAX_FNAME_SIZE) {
+		std::cerr << "Encountered buffer overflow when attempting to write directory with name \"" << a_name << "\"!" << std::endl;
+		_lastErr = FileError::kFileNameTooLong;
+		return false;
+	}
+	std::size_t length = a_dir.records.size() + sizeof(direntry_t) + nameLen;
+	if (length > MAX_DIR_SIZE) {
 		std::cerr << "Encountered directory overflow when writing directory with name \"" << a_name << "\"!" << std::endl;
 		_lastErr = FileError::kDirFull;
 		return false;
 	}
-	if (std::strlen(a_name) > MAX_FNAME_SIZE) {
-		std::cerr << "Encountered buffer overflow when attempting to write directory with name \"" << a_name << "\"!" << std::endl;
-		_lastErr = FileError::kFileNameTooLong;
-		return false;
+
+	// continuation blocks go next to the directory
+	std::size_t oldBlocks = CountDirBlocks(a_dir.records.size());
+	for (std::size_t i = oldBlocks; i < CountDirBlocks(length); ++i) {
+		a_dir.block.blocks[i] = _bfs.get_free_block(_curDirHandle);
+		if (a_dir.block.blocks[i] == kInvalidHandle) {
+			std::cerr << "Disk is full when creating file with name \"" << a_name << "\"" << std::endl;
+			_lastErr = FileError::kDiskFull;
+			while (i-- > oldBlocks) {
+				_bfs.reclaim_block(a_dir.block.blocks[i]);
+				a_dir.block.blocks[i] = kInvalidHandle;
+			}
+			return false;
+		}
 	}
 
-	entry = ForEachDirEntry(a_dir, [](DirEntry& a_entry) -> bool
+	direntry_t record;
+	std::memset(&record, 0, sizeof(record));
+	record.hash = NameHash(a_name, nameLen);
+	record.block_num = a_handle;
+	record.name_len = static_cast<unsigned char>(nameLen);
+	a_dir.records.append(reinterpret_cast<const char*>(&record), sizeof(record));
+	a_dir.records.append(a_name, nameLen);
+	a_dir.block.length = static_cast<unsigned short>(a_dir.records.size());
+	++a_dir.block.num_entries;
+	return true;
+}
+
+
+void FileSys::RemoveFromDirectory(Directory& a_dir, const DirEntry& a_entry)
+{
+	a_dir.records.erase(a_entry.offset, sizeof(direntry_t) + a_entry.name_len);
+	a_dir.block.length = static_cast<unsigned short>(a_dir.records.size());
+	--a_dir.block.num_entries;
+
+	// continuation blocks that no longer hold records are given back
+	for (std::size_t i = CountDirBlocks(a_dir.records.size()); i < MAX_DIR_BLOCKS; ++i) {
+		if (a_dir.block.blocks[i] != kInvalidHandle) {
+			_bfs.reclaim_block(a_dir.block.blocks[i]);
+			a_dir.block.blocks[i] = kInvalidHandle;
+		}
+	}
+}
+
+
+// compares the hash and length of each record before its name
+bool FileSys::FindDirEntry(const Directory& a_dir, const char* a_name, DirEntry& a_entry) const
+{
+	std::size_t nameLen = std::strlen(a_name);
+	unsigned int hash = NameHash(a_name, nameLen);
+	return ForEachDirEntry(a_dir, a_entry, [hash, nameLen, a_name](const DirEntry& a_record) -> bool
 	{
-		return a_entry.block_num == kInvalidHandle;
+		return a_record.hash == hash && a_record.name_len == nameLen && std::memcmp(a_record.name, a_name, nameLen) == 0;
 	});
+}
 
-	if (entry) {
-		std::strcpy(entry->name, a_name);
-		entry->block_num = a_handle;
-		++a_dir.num_entries;
-		return true;
-	} else {
-		std::cerr << "Could not find free block in directory! Mismatch on declared and actual entries!" << std::endl;	// This indicates file corruption
-		return false;
+
+// 32-bit FNV-1a
+unsigned int FileSys::NameHash(const char* a_name, std::size_t a_len)
+{
+	unsigned int hash = 2166136261u;
+	for (std::size_t i = 0; i < a_len; ++i) {
+		hash ^= static_cast<unsigned char>(a_name[i]);
+		hash *= 16777619u;
 	}
+	return hash;
+}
+
+
+std::size_t FileSys::CountDirBlocks(std::size_t a_length) const
+{
+	return a_length <= DIR_INLINE_SIZE ? 0 : (a_length - DIR_INLINE_SIZE + DIR_DATA_SIZE - 1) / DIR_DATA_SIZE;
 }
 
 
-std::pair<dirblock_t, bool> FileSys::ReadDirBlock(BlockHandle a_handle)
+std::pair<FileSys::Directory, bool> FileSys::ReadDirectory(BlockHandle a_handle)
 {
-	dirblock_t block;
-	_bfs.read_block(a_handle, &block);
-	bool second = IsDirectory(&block);
+	Directory dir;
+	bool second = !IsINodeHandle(a_handle);
+	if (second) {
+		_bfs.read_block(a_handle, &dir.block);
+		second = IsDirectory(&dir.block);
+	}
 	if (!second) {
 		std::cerr << "Block number " << a_handle << " is not a directory!" << std::endl;
 		_lastErr = FileError::kFileNotDir;
+		return std::make_pair(dir, second);
+	}
+
+	// gather the records from the directory block and its continuation blocks
+	std::size_t length = dir.block.length;
+	dir.records.assign(dir.block.records, std::min<std::size_t>(length, DIR_INLINE_SIZE));
+	for (std::size_t i = 0; i < MAX_DIR_BLOCKS && dir.records.size() < length; ++i) {
+		dirdatablock_t dataBlock;
+		_bfs.read_block(dir.block.blocks[i], &dataBlock);
+		dir.records.append(dataBlock.records, std::min<std::size_t>(length - dir.records.size(), DIR_DATA_SIZE));
 	}
-	return std::make_pair(block, second);
+	return std::make_pair(dir, second);
 }
 
 
-std::pair<inode_t, bool> FileSys::ReadINodeBlock(BlockHandle a_handle)
+// rewrites the directory block and the continuation blocks holding records
+// from byte a_from on
+void FileSys::WriteDirectory(BlockHandle a_handle, Directory& a_dir, std::size_t a_from)
 {
-	inode_t block;
-	_bfs.read_block(a_handle, &block);
-	bool second = IsINode(&block);
-	if (!second) {
+	std::size_t length = a_dir.records.size();
+	std::memset(a_dir.block.records, 0, DIR_INLINE_SIZE);
+	a_dir.records.copy(a_dir.block.records, DIR_INLINE_SIZE);
+	_bfs.write_block(a_handle, &a_dir.block);
+
+	std::size_t first = a_from <= DIR_INLINE_SIZE ? 0 : (a_from - DIR_INLINE_SIZE) / DIR_DATA_SIZE;
+	for (std::size_t i = first; i < CountDirBlocks(length); ++i) {
+		dirdatablock_t dataBlock;
+		std::memset(&dataBlock, 0, sizeof(dataBlock));
+		dataBlock.magic = DIR_DATA_MAGIC_NUM;
+		a_dir.records.copy(dataBlock.records, DIR_DATA_SIZE, DIR_INLINE_SIZE + i * DIR_DATA_SIZE);
+		_bfs.write_block(a_dir.block.blocks[i], &dataBlock);
+	}
+}
+
+
+std::pair<inode_t, bool> FileSys::ReadINode(BlockHandle a_handle)
+{
+	inode_t iNode;
+	bool second = IsINodeHandle(a_handle);
+	if (second) {
+		_bfs.read_inode(a_handle - kINodeHandleBase, iNode);
+	} else {
+		InitializeBlock(iNode);
 		std::cerr << "Block number " << a_handle << " is not an iNode!" << std::endl;
 		_lastErr = FileError::kFileIsDir;
 	}
-	return std::make_pair(block, second);
+	return std::make_pair(iNode, second);
+}
+
+
+void FileSys::WriteINode(BlockHandle a_handle, inode_t& a_iNode)
+{
+	++a_iNode.generation;
+	_bfs.write_inode(a_handle - kINodeHandleBase, a_iNode);
+}
+
+
+void FileSys::WriteData(BlockHandle a_handle, inode_t& a_iNode, const char* a_name, std::size_t a_offset, const char* a_data, std::size_t a_dataLen)
+{
+	std::size_t oldSize = a_iNode.size;
+	std::size_t newSize = std::max<std::size_t>(oldSize, a_offset + a_dataLen);
+	std::size_t firstIdx = a_offset / BLOCK_SIZE;
+	std::size_t lastIdx = (a_offset + a_dataLen - 1) / BLOCK_SIZE;
+	std::size_t tailIdx = oldSize / BLOCK_SIZE;
+	std::size_t finalIdx = newSize / BLOCK_SIZE;
+	bool packTail = CanPackTail(a_iNode, newSize);	// a packed tail needs no block of its own
+
+	// pick the blocks to rewrite: the written ones, and when the file grows,
+	// those past the old end that already hold bytes (the old tail or
+	// preallocated blocks), as those bytes must now read back as zeros
+	std::vector<std::size_t> indices;
+	for (std::size_t i = std::min(firstIdx, tailIdx); i <= lastIdx; ++i) {
+		bool exposed = newSize > oldSize && i >= tailIdx && (a_iNode.blocks[i] != kInvalidHandle || (i == tailIdx && a_iNode.tail_block != kInvalidHandle));
+		if (i >= firstIdx || exposed) {
+			indices.push_back(i);
+		}
+	}
+
+	// a tail that will not fit beside the other tails needs a new fragment
+	// block, promised before anything changes so a full disk fails cleanly
+	bool repackTail = packTail && indices.back() == finalIdx;
+	bool unpackTail = a_iNode.tail_block != kInvalidHandle && std::find(indices.begin(), indices.end(), tailIdx) != indices.end();
+	bool tailReserved = repackTail && !TailHasRoom(a_iNode, newSize, unpackTail);
+	if (tailReserved && !_bfs.reserve_blocks(1)) {
+		std::cerr << bad_block_alloc(a_name).what() << std::endl;
+		_lastErr = FileError::kDiskFull;
+		return;
+	}
+
+	// allocate new blocks, skipping any that were preallocated; blocks
+	// that are not written stay holes
+	std::vector<BlockHandle> handles;
+	std::size_t usedBlocks = CountBlocks(oldSize);
+	std::size_t numAllocBlocks = 0;
+	for (auto i : indices) {
+		if (a_iNode.blocks[i] == kInvalidHandle && !(packTail && i == finalIdx)) {
+			++numAllocBlocks;
+		}
+	}
+	BlockHandle oldMap = a_iNode.map_block;
+	if (numAllocBlocks > 0 && !AssignBlockMap(a_handle, a_iNode, a_name)) {
+		if (tailReserved) {
+			_bfs.release_blocks(1);
+		}
+		return;
+	}
+	BlockHandle goal = DataGoal(a_handle, a_iNode, indices.front());
+	BlockHandle extent = _bfs.get_free_extent(numAllocBlocks, goal);
+	if (extent != kInvalidHandle) {	// prefer a single contiguous run
+		for (std::size_t i = 0; i < numAllocBlocks; ++i) {
+			handles.push_back(extent + i);
+		}
+	} else {
+		try {
+			while (numAllocBlocks--) {
+				handles.push_back(_bfs.get_free_block(handles.empty() ? goal : handles.back() + 1));
+				if (handles.back() == kInvalidHandle) {
+					throw bad_block_alloc(a_name);
+				}
+			}
+		} catch (bad_block_alloc& e) {
+			std::cerr << e.what() << std::endl;
+			_lastErr = FileError::kDiskFull;
+			for (auto& handle : handles) {
+				if (handle != kInvalidHandle) {
+					_bfs.reclaim_block(handle);
+				}
+			}
+			if (oldMap == kInvalidHandle && a_iNode.map_block != kInvalidHandle) {
+				_bfs.reclaim_block(a_iNode.map_block);
+				a_iNode.map_block = kInvalidHandle;
+			}
+			if (tailReserved) {
+				_bfs.release_blocks(1);
+			}
+			return;
+		}
+	}
+
+	// copy data block by block, assigning block handles in order
+	datablock_t dataBlock;
+	std::size_t handleIdx = 0;
+	bool tailPending = false;
+	for (auto i : indices) {
+		std::size_t blockStart = i * BLOCK_SIZE;
+		std::size_t keepLen = oldSize > blockStart ? std::min<std::size_t>(oldSize - blockStart, BLOCK_SIZE) : 0;	// bytes already in the file
+		if (i == tailIdx && a_iNode.tail_block != kInvalidHandle) {
+			UnpackTail(a_iNode, dataBlock);
+		} else if (a_iNode.blocks[i] != kInvalidHandle && keepLen > 0) {
+			_bfs.read_block(a_iNode.blocks[i], &dataBlock);
+		} else {	// a hole or a block past the end starts out as zeros
+			keepLen = 0;
+		}
+		std::memset(dataBlock.data + keepLen, 0, BLOCK_SIZE - keepLen);
+
+		std::size_t from = std::max(a_offset, blockStart);
+		std::size_t to = std::min(a_offset + a_dataLen, blockStart + BLOCK_SIZE);
+		if (from < to) {
+			std::memcpy(dataBlock.data + (from - blockStart), a_data + (from - a_offset), to - from);
+		}
+
+		if (packTail && i == finalIdx) {	// always the last index
+			tailPending = true;
+		} else {
+			if (a_iNode.blocks[i] == kInvalidHandle) {
+				a_iNode.blocks[i] = handles[handleIdx++];
+			} else if (keepLen > 0 && _bfs.next_fit()) {
+				// rewritten data moves on to the next free block, so writes keep
+				// sweeping forward, unless the disk is too full to spare one
+				BlockHandle moved = _bfs.get_free_block();
+				if (moved != kInvalidHandle) {
+					_bfs.reclaim_block(a_iNode.blocks[i]);
+					a_iNode.blocks[i] = moved;
+				}
+			}
+			_bfs.write_block(a_iNode.blocks[i], &dataBlock);
+		}
+	}
+	a_iNode.size = newSize;
+	if (tailPending) {
+		if (tailReserved) {
+			_bfs.release_blocks(1);	// PackTail takes the promised block
+		}
+		PackTail(a_iNode, dataBlock);
+	}
+
+	// preallocated blocks that now lie inside the file are no longer reserved
+	std::size_t reservedEnd = usedBlocks + a_iNode.reserved;
+	usedBlocks = CountBlocks(a_iNode.size);
+	a_iNode.reserved = reservedEnd > usedBlocks ? reservedEnd - usedBlocks : 0;
+	WriteINode(a_handle, a_iNode);
+}
+
+
+void FileSys::ReadData(const inode_t& a_iNode, std::size_t a_offset, std::size_t a_count)
+{
+	if (a_offset >= a_iNode.size) {
+		return;
+	}
+
+	std::size_t end = a_count < a_iNode.size - a_offset ? a_offset + a_count : a_iNode.size;
+	for (std::size_t i = a_offset / BLOCK_SIZE; i < CountBlocks(end); ++i) {
+		datablock_t dataBlock;
+		const char* data = MapFileBlock(a_iNode, i);	// a mapped disk is read in place
+		if (!data) {
+			ReadFileBlock(a_iNode, i, dataBlock);
+			data = dataBlock.data;
+		}
+		std::size_t from = std::max(a_offset, i * BLOCK_SIZE);
+		std::size_t to = std::min(end, (i + 1) * BLOCK_SIZE);
+		_response.write(data + (from - i * BLOCK_SIZE), to - from);
+	}
+}
+
+
+bool FileSys::CanPackTail(const inode_t& a_iNode, std::size_t a_size) const
+{
+	std::size_t tailLen = a_size % BLOCK_SIZE;
+	return tailLen != 0 && tailLen <= MAX_TAIL_SIZE && a_iNode.reserved == 0 && a_iNode.blocks[a_size / BLOCK_SIZE] == kInvalidHandle;
+}
+
+
+void FileSys::PackTail(inode_t& a_iNode, const datablock_t& a_tail)
+{
+	std::size_t tailLen = a_iNode.size % BLOCK_SIZE;
+	std::size_t numFrags = (tailLen + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+
+	// try the fragment block that last had room, then start a new one
+	fragblock_t fragBlock;
+	int fragIdx = -1;
+	if (_fragHint != kInvalidHandle) {
+		_bfs.read_block(_fragHint, &fragBlock);
+		if (IsFragBlock(&fragBlock)) {
+			fragIdx = FindFreeFragments(fragBlock, numFrags);
+		}
+	}
+	if (fragIdx < 0) {
+		_fragHint = _bfs.get_free_block(_curDirHandle);
+		if (_fragHint == kInvalidHandle) {	// WriteData promised a block, so this is a bug
+			std::cerr << "Disk is full when attempting to pack the tail of a file!" << std::endl;
+			_lastErr = FileError::kDiskFull;
+			return;
+		}
+		InitializeBlock(fragBlock);
+		fragIdx = 0;
+	}
+
+	for (std::size_t i = fragIdx; i < fragIdx + numFrags; ++i) {
+		fragBlock.bitmap[i / 8] |= 1 << (i % 8);
+	}
+	std::memcpy(fragBlock.data + fragIdx * FRAGMENT_SIZE, a_tail.data, tailLen);
+	_bfs.write_block(_fragHint, &fragBlock);
+
+	a_iNode.tail_block = _fragHint;
+	a_iNode.tail_offset = fragIdx * FRAGMENT_SIZE;
+}
+
+
+bool FileSys::TailHasRoom(const inode_t& a_iNode, std::size_t a_size, bool a_unpack)
+{
+	// PackTail tries the fragment block that last had room, which is the
+	// old tail's block once the old tail is unpacked
+	BlockHandle handle = a_unpack ? a_iNode.tail_block : _fragHint;
+	if (handle == kInvalidHandle) {
+		return false;
+	}
+
+	fragblock_t fragBlock;
+	_bfs.read_block(handle, &fragBlock);
+	if (!IsFragBlock(&fragBlock)) {
+		return false;
+	}
+
+	// a block left without tails is freed, and taken again for the new one
+	if (a_unpack) {
+		std::size_t oldFrags = (a_iNode.size % BLOCK_SIZE + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+		std::size_t oldIdx = a_iNode.tail_offset / FRAGMENT_SIZE;
+		for (std::size_t i = oldIdx; i < oldIdx + oldFrags; ++i) {
+			fragBlock.bitmap[i / 8] &= ~(1 << (i % 8));
+		}
+		if (std::all_of(fragBlock.bitmap, fragBlock.bitmap + sizeof(fragBlock.bitmap), [](unsigned char a_bits) { return a_bits == 0; })) {
+			return true;
+		}
+	}
+	return FindFreeFragments(fragBlock, (a_size % BLOCK_SIZE + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE) >= 0;
+}
+
+
+void FileSys::UnpackTail(inode_t& a_iNode, datablock_t& a_tail)
+{
+	std::size_t tailLen = a_iNode.size % BLOCK_SIZE;
+	std::size_t numFrags = (tailLen + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+	std::size_t fragIdx = a_iNode.tail_offset / FRAGMENT_SIZE;
+
+	fragblock_t fragBlock;
+	_bfs.read_block(a_iNode.tail_block, &fragBlock);
+	std::memcpy(a_tail.data, fragBlock.data + a_iNode.tail_offset, tailLen);
+
+	// free the fragments, and the whole block once it holds no tails
+	bool empty = true;
+	for (std::size_t i = fragIdx; i < fragIdx + numFrags; ++i) {
+		fragBlock.bitmap[i / 8] &= ~(1 << (i % 8));
+	}
+	for (std::size_t i = 0; i < sizeof(fragBlock.bitmap); ++i) {
+		if (fragBlock.bitmap[i] != 0) {
+			empty = false;
+		}
+	}
+	if (empty) {
+		_bfs.reclaim_block(a_iNode.tail_block);
+		if (_fragHint == a_iNode.tail_block) {
+			_fragHint = kInvalidHandle;
+		}
+	} else {
+		_bfs.write_block(a_iNode.tail_block, &fragBlock);
+		_fragHint = a_iNode.tail_block;
+	}
+
+	a_iNode.tail_block = kInvalidHandle;
+	a_iNode.tail_offset = 0;
+}
+
+
+int FileSys::FindFreeFragments(const fragblock_t& a_block, std::size_t a_count) const
+{
+	std::size_t len = 0;
+	for (std::size_t i = 0; i < NUM_FRAGMENTS; ++i) {
+		if (a_block.bitmap[i / 8] & (1 << (i % 8))) {
+			len = 0;
+		} else if (++len == a_count) {
+			return i + 1 - a_count;
+		}
+	}
+	return -1;
+}
+
+
+void FileSys::ReadFileBlock(const inode_t& a_iNode, std::size_t a_idx, datablock_t& a_block)
+{
+	if (a_iNode.tail_block != kInvalidHandle && a_idx == a_iNode.size / BLOCK_SIZE) {
+		fragblock_t fragBlock;
+		_bfs.read_block(a_iNode.tail_block, &fragBlock);
+		std::memcpy(a_block.data, fragBlock.data + a_iNode.tail_offset, a_iNode.size % BLOCK_SIZE);
+	} else if (a_iNode.blocks[a_idx] == kInvalidHandle) {	// holes read back as zeros
+		std::memset(a_block.data, 0, BLOCK_SIZE);
+	} else {
+		_bfs.read_block(a_iNode.blocks[a_idx], &a_block);
+	}
+}
+
+
+const char* FileSys::MapFileBlock(const inode_t& a_iNode, std::size_t a_idx) const
+{
+	if (a_iNode.tail_block != kInvalidHandle && a_idx == a_iNode.size / BLOCK_SIZE) {
+		const char* frag = _bfs.mapped_block(a_iNode.tail_block);
+		return frag ? frag + offsetof(fragblock_t, data) + a_iNode.tail_offset : nullptr;
+	} else if (a_iNode.blocks[a_idx] == kInvalidHandle) {
+		return nullptr;
+	} else {
+		return _bfs.mapped_block(a_iNode.blocks[a_idx]);
+	}
+}
+
+
+void FileSys::FlushDelayedWrite(BlockHandle a_handle)
+{
+	auto it = _delayedWrites.find(a_handle);
+	if (it == _delayedWrites.end()) {
+		return;
+	}
+
+	DelayedWrite write = std::move(it->second);
+	_delayedWrites.erase(it);
+	_delayedBytes -= write.data.size();
+	_bfs.release_blocks(write.numBlocks);
+
+	// the data belongs to the append that delayed it, so a failure here is
+	// kept apart from the error of the command that set off the flush. The
+	// blocks were reserved at append time, so it should never happen.
+	FileError cmdErr = _lastErr;
+	_lastErr = FileError::kOK;
+	auto iNode = ReadINode(a_handle);
+	if (iNode.second) {
+		WriteData(a_handle, iNode.first, write.name.c_str(), iNode.first.size, write.data.data(), write.data.size());
+	}
+	if (_lastErr != FileError::kOK) {
+		std::cerr << "Lost " << write.data.size() << " bytes appended to file with name \"" << write.name << "\" while flushing them!" << std::endl;
+		_flushErr = _lastErr;
+		if (_bfs.in_transaction()) {
+			_txnFailed = true;
+		}
+	}
+	_lastErr = cmdErr;
+}
+
+
+void FileSys::FlushDelayedWrites()
+{
+	while (!_delayedWrites.empty()) {
+		FlushDelayedWrite(_delayedWrites.begin()->first);
+	}
+}
+
+
+void FileSys::DiscardDelayedWrite(BlockHandle a_handle)
+{
+	auto it = _delayedWrites.find(a_handle);
+	if (it != _delayedWrites.end()) {
+		_delayedBytes -= it->second.data.size();
+		_bfs.release_blocks(it->second.numBlocks);
+		_delayedWrites.erase(it);
+	}
+}
+
+
+void FileSys::IndexRecords(RecordIndex& a_index, std::size_t a_offset, const char* a_data, std::size_t a_len) const
+{
+	for (std::size_t i = 0; i < a_len; ++i) {
+		if (a_index.atStart) {
+			if (a_index.count % kRecordIndexStride == 0) {
+				a_index.starts.push_back(a_offset + i);
+			}
+			++a_index.count;
+		}
+		a_index.atStart = a_data[i] == '\n';
+	}
+}
+
+
+const FileSys::RecordIndex& FileSys::FindRecordIndex(BlockHandle a_handle, const inode_t& a_iNode)
+{
+	auto it = _recordIndexes.find(a_handle);
+	if (it != _recordIndexes.end()) {
+		return it->second;
+	}
+
+	RecordIndex& index = _recordIndexes[a_handle];
+	for (std::size_t i = 0; i < CountBlocks(a_iNode.size); ++i) {
+		datablock_t dataBlock;
+		ReadFileBlock(a_iNode, i, dataBlock);
+		IndexRecords(index, i * BLOCK_SIZE, dataBlock.data, std::min<std::size_t>(BLOCK_SIZE, a_iNode.size - i * BLOCK_SIZE));
+	}
+	return index;
+}
+
+
+std::size_t FileSys::SkipRecords(const inode_t& a_iNode, std::size_t a_offset, std::size_t a_count)
+{
+	for (std::size_t i = a_offset / BLOCK_SIZE; a_count > 0 && i < CountBlocks(a_iNode.size); ++i) {
+		datablock_t dataBlock;
+		ReadFileBlock(a_iNode, i, dataBlock);
+		std::size_t end = std::min<std::size_t>(a_iNode.size, (i + 1) * BLOCK_SIZE);
+		for (; a_offset < end; ++a_offset) {
+			if (dataBlock.data[a_offset - i * BLOCK_SIZE] == '\n' && --a_count == 0) {
+				return a_offset + 1;
+			}
+		}
+	}
+	return a_offset;
+}
+
+
+std::size_t FileSys::CountBlocks(std::size_t a_size) const
+{
+	return (a_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+
+std::size_t FileSys::CountUnassignedBlocks(const inode_t& a_iNode, std::size_t a_size) const
+{
+	std::size_t count = 0;
+	for (std::size_t i = a_iNode.size / BLOCK_SIZE; i < CountBlocks(a_size); ++i) {
+		if (a_iNode.blocks[i] == kInvalidHandle) {
+			++count;
+		}
+	}
+	if (count > 0 && a_iNode.map_block == kInvalidHandle) {	// the first data block brings the block map
+		++count;
+	}
+	return count;
+}
+
+
+// delayed writes made since the transaction began are its own, as
+// begin flushed the ones before it
+void FileSys::RollBackTransaction()
+{
+	_delayedWrites.clear();
+	_delayedBytes = 0;
+	_recordIndexes.clear();	// they may cover appends the transaction made
+	_fragHint = kInvalidHandle;
+	_bfs.abort_transaction();
+	_curDirHandle = _txnDirHandle;
+}
+
+
+bool FileSys::Writable() const
+{
+	if (_bfs.read_only()) {
+		std::cerr << "File system is mounted read-only!" << std::endl;
+		_lastErr = FileError::kReadOnly;
+		return false;
+	}
+	return true;
 }
 
 
@@ -6,9 +6,13 @@
 
 
 #include <iostream>  // cerr
+#include <cstddef>  // size_t
+#include <cstring>  // memcpy
 #include <sstream>  // stringstream
-#include <type_traits>  // remove_reference
+#include <string>  // string
+#include <unordered_map>  // unordered_map
 #include <utility>  // pair
+#include <vector>  // vector
 
 #include "BasicFileSys.h"
 #include "Blocks.h"
@@ -38,15 +42,32 @@ enum class FileError
 {
 	kOK = 0,
 	kFileNotDir = 500,	// cd, rmdir
-	kFileIsDir,	// cat, head, append, rm
+	kFileIsDir,	// cat, head, read, readrec, append, appendrec, write, prealloc, rm, append-if, write-if, cat-if-changed
 	kFileExists,	// create, mkdir
-	kFileNotExists,	// cd, rmdir, cat, head, append, rm, stat
+	kFileNotExists,	// cd, rmdir, cat, head, read, readrec, append, appendrec, write, prealloc, rm, stat, append-if, write-if, cat-if-changed
 	kFileNameTooLong,	// create, mkdir
-	kDiskFull,	// create, mkdir, append
+	kDiskFull,	// create, mkdir, append, appendrec, write, prealloc, append-if, write-if
 	kDirFull,	// create, mkdir
 	kDirNotEmpty,	// rmdir
-	kAppendExceedsMaxSize,	// append
-	kCommandNotFound
+	kAppendExceedsMaxSize,	// append, appendrec, write, prealloc, append-if, write-if
+	kCommandNotFound,
+	kInTransaction,	// begin
+	kNotInTransaction,	// commit, abort
+	kTransactionFailed,	// commit
+	kGenerationMismatch,	// append-if, write-if
+	kNotModified,	// cat-if-changed
+	kReadOnly,	// mkdir, rmdir, create, append, appendrec, write, prealloc, rm, append-if, write-if, begin, commit, abort
+	kVolumeNotFound,	// volume
+	kVolumeBusy,	// volume
+	kBadRequest	// any command whose arguments cannot be parsed
+};
+
+
+enum class Durability
+{
+	kNone = 0,	// changes may stay in server memory
+	kFlushed,	// changes are written to the disk file
+	kSynced	// changes are written and synced to the device
 };
 
 
@@ -56,7 +77,7 @@ public:
 	FileSys();
 
 	// mounts the file system
-	void mount(socket_t a_sock);
+	void mount(socket_t a_sock, const MountOptions& a_options);
 
 	// unmounts the file system
 	void unmount();
@@ -82,90 +103,242 @@ public:
 	// append data to a data file
 	void append(const char* a_name, const char* a_data);
 
+	// append data to a data file as one whole record, and display the byte offset it starts at
+	void appendrec(const char* a_name, const char* a_data);
+
+	// write data to a data file at a byte offset, leaving a hole past the old end
+	void write(const char* a_name, unsigned int a_offset, const char* a_data);
+
+	// reserve blocks so a data file can grow to N bytes without further allocation
+	void prealloc(const char* a_name, unsigned int a_size);
+
 	// display the contents of a data file
 	void cat(const char* a_name);
 
 	// display the first N bytes of the file
 	void head(const char* a_name, unsigned int a_size);
 
+	// display N bytes of the file starting at a byte offset
+	void read(const char* a_name, unsigned int a_offset, unsigned int a_size);
+
+	// display N newline-terminated records of the file starting at a record number
+	void readrec(const char* a_name, unsigned int a_from, unsigned int a_count);
+
 	// delete a data file
 	void rm(const char* a_name);
 
 	// display stats about file or directory
 	void stat(const char* a_name);
 
+	// display statistics about the block cache and free space
+	void stats();
+
+	// make the changes so far at least as durable as the given level
+	void commit(Durability a_level);
+
+	// read part of the warm-up list into the block cache, returns true
+	// while there is more to read
+	bool prefetch();
+
+	// free a batch of the blocks of removed files, returns true while there
+	// is more to free
+	bool reclaim();
+
+	// append data to a data file if its generation is still a_generation, and display its new generation
+	void appendIf(const char* a_name, unsigned int a_generation, const char* a_data);
+
+	// write data to a data file at a byte offset if its generation is still a_generation, and display its new generation
+	void writeIf(const char* a_name, unsigned int a_generation, unsigned int a_offset, const char* a_data);
+
+	// display the generation and contents of a data file, or nothing but NOT_MODIFIED if its generation is still a_generation
+	void catIfChanged(const char* a_name, unsigned int a_generation);
+
+	// start a transaction, the commands after it take effect together when it commits
+	void beginTransaction();
+
+	// apply the changes of the transaction all at once, or none of them if a command in it failed
+	void commitTransaction();
+
+	// drop the changes of the transaction
+	void abortTransaction();
+
 	std::string getQueryResponse() const;	// returns and clears the response message from the last issued command
 	FileError getLastErr() const noexcept;	// returns and clears the last encountered error
+	FileError getFlushErr() noexcept;	// returns and clears the error of the last delayed data that failed to flush
 
 private:
-	using BlockHandle = decltype(dirblock_t::dir_entries[0].block_num);	// type for block handle
-	using DirEntry = std::remove_reference<decltype(dirblock_t::dir_entries[0])>::type;	// type for directory entry
+	using BlockHandle = decltype(direntry_t::block_num);	// type for block handle
 
 
 	enum
 	{
 		kInvalidHandle = 0,
 		kSuperBlockHandle = 0,
-		kRootDirHandle = 1
+		kRootDirHandle = 1,
+		kINodeHandleBase = NUM_BLOCKS	// data files are named by kINodeHandleBase + their inode number
+	};
+
+
+	enum : std::size_t
+	{
+		kDelayedFlushSize = BLOCK_SIZE * 8,	// delayed bytes in one file that trigger its flush
+		kDelayedFlushTotal = BLOCK_SIZE * 64,	// delayed bytes across all files that trigger a full flush
+		kRecordIndexStride = 16	// records between two entries of a record index
+	};
+
+
+	// a directory block with all of its records gathered from its
+	// continuation blocks
+	struct Directory
+	{
+		dirblock_t block;	// directory block
+		std::string records;	// every record in the directory, block.length bytes
+	};
+
+
+	// one record of a directory
+	struct DirEntry
+	{
+		std::size_t offset = 0;	// byte offset of the record in the directory's records
+		unsigned int hash = 0;	// hash of the name
+		BlockHandle block_num = 0;	// block number of a directory, or iNode handle of a data file
+		const char* name = 0;	// name, not null-terminated, points into the directory's records
+		std::size_t name_len = 0;	// length of the name
+	};
+
+
+	// where every kRecordIndexStride-th record of a data file starts, so a
+	// record is found by scanning no more than that many records. A record
+	// ends with a newline.
+	struct RecordIndex
+	{
+		std::vector<std::size_t> starts;	// byte offsets of records 0, kRecordIndexStride, 2 * kRecordIndexStride, ...
+		std::size_t count = 0;	// number of records, the last one may not have its newline yet
+		bool atStart = true;	// true if the next byte appended starts a new record
+	};
+
+
+	// data appended to a file that has not been assigned blocks yet
+	struct DelayedWrite
+	{
+		std::string name;	// file name, for error messages
+		std::string data;	// bytes to append at the end of the file
+		std::size_t numBlocks = 0;	// blocks promised to the data by the allocator
 	};
 
 
 	bool IsDirectory(void* a_block) const;	// returns true if the block is a directory
-	bool IsINode(void* a_block) const;	// returns true if the block is an inode
+	bool IsINodeHandle(BlockHandle a_handle) const;	// returns true if the handle names a data file's inode
+	bool IsFragBlock(void* a_block) const;	// returns true if the block is a fragment block
 	void InitializeBlock(dirblock_t& a_block) const;	// initializes the directory block
-	void InitializeBlock(inode_t& a_block) const;	// initializes the iNode block
+	void InitializeBlock(inode_t& a_block) const;	// initializes the iNode
+	void InitializeBlock(fragblock_t& a_block) const;	// initializes the fragment block
 	void InitializeBlock(datablock_t& a_block) const;	// initializes the data block
-	bool InsertIntoDirectory(dirblock_t& a_dir, BlockHandle a_handle, const char* a_name);	// inserts the block into the directory
-	std::pair<dirblock_t, bool> ReadDirBlock(BlockHandle a_handle);	// first == directory block, second == success/failure
-	std::pair<inode_t, bool> ReadINodeBlock(BlockHandle a_handle);	// first == iNode block, second == success/failure
+	BlockHandle AllocateHandle(const dirblock_t&);	// allocates a directory block, spread out over the block groups
+	BlockHandle AllocateHandle(const inode_t&);	// allocates an iNode in the block group of the current directory
+	void FreeHandle(BlockHandle a_handle);	// frees the directory block or iNode
+	void WriteNewBlock(BlockHandle a_handle, dirblock_t& a_block);	// writes out a new directory
+	void WriteNewBlock(BlockHandle a_handle, inode_t& a_block);	// writes out a new iNode
+	BlockHandle DataGoal(BlockHandle a_handle, const inode_t& a_iNode, std::size_t a_idx) const;	// returns the block new data at index a_idx of the file should be placed near
+	bool FindFile(const char* a_name, BlockHandle& a_handle);	// looks up the data file in the current directory and writes its delayed data, returns false if it is not there
+	bool CheckGeneration(const char* a_name, const inode_t& a_iNode, unsigned int a_generation);	// returns false with kGenerationMismatch and the current generation as the response if the file has changed
+	bool AppendRecord(const char* a_name, const char* a_data, std::size_t& a_offset);	// appends the data whole or not at all at the end of the file, a_offset gets where it starts
+	bool AssignBlockMap(BlockHandle a_handle, inode_t& a_iNode, const char* a_name);	// gives the file a block map if it has none, returns false if the disk is full
+	bool InsertIntoDirectory(Directory& a_dir, BlockHandle a_handle, const char* a_name);	// inserts the block into the directory, allocating continuation blocks as needed
+	void RemoveFromDirectory(Directory& a_dir, const DirEntry& a_entry);	// removes the record from the directory, freeing continuation blocks it no longer needs
+	bool FindDirEntry(const Directory& a_dir, const char* a_name, DirEntry& a_entry) const;	// looks up the name in the directory, returns false if it is not there
+	static unsigned int NameHash(const char* a_name, std::size_t a_len);	// returns the hash stored with a name in its directory record
+	std::size_t CountDirBlocks(std::size_t a_length) const;	// returns the number of continuation blocks needed to hold a_length bytes of records
+	std::pair<Directory, bool> ReadDirectory(BlockHandle a_handle);	// first == directory, second == success/failure
+	void WriteDirectory(BlockHandle a_handle, Directory& a_dir, std::size_t a_from);	// writes the directory block and the continuation blocks from byte a_from of the records on
+	std::pair<inode_t, bool> ReadINode(BlockHandle a_handle);	// first == iNode, second == success/failure
+	void WriteINode(BlockHandle a_handle, inode_t& a_iNode);	// bumps the generation of the iNode and writes it with its block map
+	void WriteData(BlockHandle a_handle, inode_t& a_iNode, const char* a_name, std::size_t a_offset, const char* a_data, std::size_t a_dataLen);	// assigns blocks to and writes data at a byte offset of the file
+	void ReadData(const inode_t& a_iNode, std::size_t a_offset, std::size_t a_count);	// writes up to a_count bytes of the file from a byte offset to the response
+	bool CanPackTail(const inode_t& a_iNode, std::size_t a_size) const;	// returns true if the last partial block of a file of a_size bytes would be packed
+	bool TailHasRoom(const inode_t& a_iNode, std::size_t a_size, bool a_unpack);	// returns true if PackTail can place the tail of a file of a_size bytes without a new block, once the old tail is unpacked if a_unpack is set
+	void PackTail(inode_t& a_iNode, const datablock_t& a_tail);	// moves the last partial block of the file into a fragment block, which TailHasRoom or a promised block makes sure of
+	void UnpackTail(inode_t& a_iNode, datablock_t& a_tail);	// copies the packed tail of the file out and frees its fragments
+	int FindFreeFragments(const fragblock_t& a_block, std::size_t a_count) const;	// returns the first of a_count free fragments in a row, or -1
+	void ReadFileBlock(const inode_t& a_iNode, std::size_t a_idx, datablock_t& a_block);	// reads the a_idx-th block of the file, wherever it is stored
+	const char* MapFileBlock(const inode_t& a_iNode, std::size_t a_idx) const;	// returns the a_idx-th block of the file in the mapped disk, or nullptr if it is not mapped or is a hole
+	void FlushDelayedWrite(BlockHandle a_handle);	// assigns blocks to and writes the delayed data of the file
+	void FlushDelayedWrites();	// assigns blocks to and writes the delayed data of every file
+	void DiscardDelayedWrite(BlockHandle a_handle);	// drops the delayed data of the file without writing it
+	void IndexRecords(RecordIndex& a_index, std::size_t a_offset, const char* a_data, std::size_t a_len) const;	// adds the records in data appended at a byte offset to the index
+	const RecordIndex& FindRecordIndex(BlockHandle a_handle, const inode_t& a_iNode);	// returns the record index of the file, building it from the file's data the first time
+	std::size_t SkipRecords(const inode_t& a_iNode, std::size_t a_offset, std::size_t a_count);	// returns the byte offset a_count records after the record starting at a_offset, or the file size
+	std::size_t CountBlocks(std::size_t a_size) const;	// returns the number of data blocks needed to hold a_size bytes
+	std::size_t CountUnassignedBlocks(const inode_t& a_iNode, std::size_t a_size) const;	// returns the number of blocks to allocate for the file to grow to a_size bytes
+	void RollBackTransaction();	// drops the changes of the open transaction and returns to the directory it began in
+	bool Writable() const;	// returns false with kReadOnly if the disk is mounted read-only
 	void PrintFailedToFindFile(const char* a_fileName) const;	// prints an error message indicating failure to find the specified file
-	template <typename Condition> DirEntry* ForEachDirEntry(dirblock_t& a_directory, Condition a_func);	// iterates over each entry in the directory, uses a_func to determine when to stop
+	template <typename Condition> bool ForEachDirEntry(const Directory& a_directory, DirEntry& a_entry, Condition a_func) const;	// iterates over each entry in the directory, uses a_func to determine when to stop, leaving that entry in a_entry
 	template <typename BlockType> void MakeBlock(const char* a_name);	// Makes a block of the given type
 
 
 	// members
 	BasicFileSys _bfs;	// basic file system
+	std::unordered_map<BlockHandle, DelayedWrite> _delayedWrites;	// data waiting for block assignment, keyed by iNode
+	std::size_t _delayedBytes;	// total bytes waiting for block assignment
+	BlockHandle _fragHint;	// fragment block that last had room for a tail
+	std::unordered_map<BlockHandle, RecordIndex> _recordIndexes;	// record indexes of the files read by record so far, keyed by iNode
 	BlockHandle _curDirHandle;	// current directory
+	BlockHandle _txnDirHandle;	// current directory when the open transaction began
+	mutable bool _txnFailed;	// true if a command failed since the open transaction began
 	socket_t _fsSock;  // file server socket
 	mutable FileError _lastErr;	// last encountered error
+	FileError _flushErr;	// error of the last delayed data that failed to flush, kept apart from _lastErr
 	mutable std::stringstream _response;	// response message to last command
 };
 
 
-// using Condition = bool(DirEntry& a_entry);
+// using Condition = bool(const DirEntry& a_entry);
 template <typename Condition>
-auto FileSys::ForEachDirEntry(dirblock_t& a_directory, Condition a_func)
-->DirEntry*
+bool FileSys::ForEachDirEntry(const Directory& a_directory, DirEntry& a_entry, Condition a_func) const
 {
-	for (std::size_t i = 0; i < MAX_DIR_ENTRIES; ++i) {
-		if (a_func(a_directory.dir_entries[i])) {
-			return &a_directory.dir_entries[i];
+	const std::string& records = a_directory.records;
+	std::size_t offset = 0;
+	while (offset + sizeof(direntry_t) <= records.size()) {
+		direntry_t record;
+		std::memcpy(&record, records.data() + offset, sizeof(record));
+		a_entry.offset = offset;
+		a_entry.hash = record.hash;
+		a_entry.block_num = record.block_num;
+		a_entry.name = records.data() + offset + sizeof(record);
+		a_entry.name_len = record.name_len;
+		if (a_func(a_entry)) {
+			return true;
 		}
+		offset += sizeof(record) + record.name_len;
 	}
-	return 0;
+	return false;
 }
 
 
 template <typename BlockType>
 void FileSys::MakeBlock(const char* a_name)
 {
-	dirblock_t curDir;
-	_bfs.read_block(_curDirHandle, &curDir);
+	auto curDir = ReadDirectory(_curDirHandle);
+	if (!curDir.second) {
+		return;
+	}
 
-	BlockHandle handle = _bfs.get_free_block();
+	BlockType block;
+	InitializeBlock(block);
+	BlockHandle handle = AllocateHandle(block);
 	if (handle == kInvalidHandle) {
 		std::cerr << "Disk is full when creating file with name \"" << a_name << "\"" << std::endl;
 		_lastErr = FileError::kDiskFull;
 		return;
 	}
-	BlockType block;
-	InitializeBlock(block);
 
-	if (!InsertIntoDirectory(curDir, handle, a_name)) {
-		_bfs.reclaim_block(handle);
+	std::size_t oldLength = curDir.first.records.size();
+	if (!InsertIntoDirectory(curDir.first, handle, a_name)) {
+		FreeHandle(handle);
 	} else {
-		_bfs.write_block(handle, &block);
-		_bfs.write_block(_curDirHandle, &curDir);
+		WriteNewBlock(handle, block);
+		WriteDirectory(_curDirHandle, curDir.first, oldLength);
 	}
 }
 
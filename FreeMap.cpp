@@ -0,0 +1,320 @@
+// CPSC 3500: Free Map
+// Keeps an in-memory copy of the free block bitmap with summary levels
+// above it, and an index of its runs of free blocks, so free blocks and
+// runs are found without scanning the bitmap.
+
+#include "FreeMap.h"
+
+#include <algorithm>  // min
+
+#if _WIN32
+#include <intrin.h>  // _BitScanForward64, __popcnt64
+#endif
+
+
+namespace
+{
+	// Number of bits in a word of the map
+	const int WORD_BITS = 64;
+
+
+	// Returns the index of the lowest set bit; a_bits must not be 0.
+	int lowest_bit(std::uint64_t a_bits)
+	{
+#if _WIN32
+		unsigned long index;
+		_BitScanForward64(&index, a_bits);
+		return static_cast<int>(index);
+#else
+		return __builtin_ctzll(a_bits);
+#endif
+	}
+
+
+	// Returns the number of set bits.
+	int count_bits(std::uint64_t a_bits)
+	{
+#if _WIN32
+		return static_cast<int>(__popcnt64(a_bits));
+#else
+		return __builtin_popcountll(a_bits);
+#endif
+	}
+}
+
+
+FreeMap::FreeMap() :
+	_levels(),
+	_numBlocks(0),
+	_runsByStart(),
+	_runsByLength(),
+	_groupBlocks(1),
+	_runsByGroup()
+{}
+
+// Rebuilds the map from a superblock bitmap of a_numBlocks bits, where a
+// set bit marks a used block. Runs are also indexed by the group of
+// a_groupBlocks blocks they start in.
+void FreeMap::load(const unsigned char *a_bitmap, int a_numBlocks, int a_groupBlocks)
+{
+	_numBlocks = a_numBlocks;
+	_groupBlocks = a_groupBlocks;
+	_levels.clear();
+
+	// bits past the last block stay clear, so they are never handed out
+	std::vector<std::uint64_t> blocks((a_numBlocks + WORD_BITS - 1) / WORD_BITS, 0);
+	for (int block = 0; block < a_numBlocks; block++) {
+		if (!(a_bitmap[block / 8] & (1 << (block % 8)))) {
+			blocks[block / WORD_BITS] |= std::uint64_t(1) << (block % WORD_BITS);
+		}
+	}
+	_levels.push_back(blocks);
+
+	// summarize until a single word covers the level below
+	do {
+		const std::vector<std::uint64_t> &below = _levels.back();
+		std::vector<std::uint64_t> level((below.size() + WORD_BITS - 1) / WORD_BITS, 0);
+		for (std::size_t word = 0; word < below.size(); word++) {
+			if (below[word] != 0) {
+				level[word / WORD_BITS] |= std::uint64_t(1) << (word % WORD_BITS);
+			}
+		}
+		_levels.push_back(level);
+	} while (_levels.back().size() > 1);
+
+	// index the runs of free blocks
+	_runsByStart.clear();
+	_runsByLength.clear();
+	_runsByGroup.assign((a_numBlocks + a_groupBlocks - 1) / a_groupBlocks, std::set<std::pair<int, int>>());
+	int start = -1;
+	for (int block = 0; block <= a_numBlocks; block++) {
+		bool free = block < a_numBlocks && is_free(block);
+		if (free && start < 0) {
+			start = block;
+		} else if (!free && start >= 0) {
+			add_run(start, block - start);
+			start = -1;
+		}
+	}
+}
+
+// Returns the lowest free block, or -1 if every block is used.
+int FreeMap::find_free() const
+{
+	return next_set(0, 0);
+}
+
+// Returns the lowest free block in [a_from, a_end), or -1 if there is none.
+int FreeMap::find_free(int a_from, int a_end) const
+{
+	if (a_from >= a_end) return -1;
+	int block = next_set(0, a_from);
+	return block < a_end ? block : -1;
+}
+
+// Returns the number of free blocks in [a_from, a_end).
+int FreeMap::count_free(int a_from, int a_end) const
+{
+	int count = 0;
+	for (int block = a_from; block < a_end;) {
+		std::uint64_t bits = _levels[0][block / WORD_BITS] >> (block % WORD_BITS);
+		int len = std::min(WORD_BITS - block % WORD_BITS, a_end - block);
+		if (len < WORD_BITS) bits &= (std::uint64_t(1) << len) - 1;
+		count += count_bits(bits);
+		block += len;
+	}
+	return count;
+}
+
+// Returns the first block of the shortest run of at least a_count free
+// blocks, the lowest such run if several are as short, or -1 if no run is
+// long enough.
+int FreeMap::find_run(int a_count) const
+{
+	if (a_count <= 0) return -1;
+
+	auto run = _runsByLength.lower_bound(std::make_pair(a_count, -1));
+	if (run == _runsByLength.end()) return -1;
+	return run->second;
+}
+
+// Like find_run, but only considers runs that start in [a_from, a_end),
+// counting a run that covers a_from as starting there. A range covering
+// whole groups is looked up in their length indexes in logarithmic time; a
+// group only partly in the range may have to skip its runs that start
+// outside it, so the worst case is linear in the runs of that group.
+int FreeMap::find_run(int a_count, int a_from, int a_end) const
+{
+	if (a_count <= 0) return -1;
+	a_end = std::min(a_end, _numBlocks);
+
+	// a run starting before a_from may still reach into the range, and
+	// wins ties as it is the lowest
+	int best = -1;
+	int bestLen = 0;
+	auto run = _runsByStart.upper_bound(a_from);
+	if (run != _runsByStart.begin()) {
+		auto prev = run;
+		--prev;
+		int len = prev->first + prev->second - a_from;
+		if (len >= a_count) {
+			best = a_from;
+			bestLen = len;
+		}
+	}
+	for (int group = a_from / _groupBlocks; a_from < a_end && group <= (a_end - 1) / _groupBlocks; group++) {
+		int start = group_run(group, a_count, a_from, a_end);
+		if (start < 0) continue;
+		int len = _runsByStart.find(start)->second;
+		if (best < 0 || len < bestLen) {
+			best = start;
+			bestLen = len;
+		}
+	}
+	return best;
+}
+
+// Returns the first block of the lowest run of at least a_count free
+// blocks that starts in [a_from, a_end), counting a run that covers
+// a_from as starting there, or -1 if there is none.
+int FreeMap::find_first_run(int a_count, int a_from, int a_end) const
+{
+	if (a_count <= 0) return -1;
+
+	auto run = _runsByStart.upper_bound(a_from);
+	if (run != _runsByStart.begin()) {
+		auto prev = run;
+		--prev;
+		if (prev->first + prev->second - a_from >= a_count) {
+			return a_from;
+		}
+	}
+	for (; run != _runsByStart.end() && run->first < a_end; ++run) {
+		if (run->second >= a_count) {
+			return run->first;
+		}
+	}
+	return -1;
+}
+
+// Returns the length of the longest run of free blocks.
+int FreeMap::largest_run() const
+{
+	return _runsByLength.empty() ? 0 : _runsByLength.rbegin()->first;
+}
+
+// Returns the number of separate runs of free blocks.
+int FreeMap::run_count() const
+{
+	return static_cast<int>(_runsByStart.size());
+}
+
+// Returns true if the block is free.
+bool FreeMap::is_free(int a_block) const
+{
+	return (_levels[0][a_block / WORD_BITS] >> (a_block % WORD_BITS)) & 1;
+}
+
+// Marks the block as used. Does nothing if it is used already.
+void FreeMap::mark_used(int a_block)
+{
+	if (!is_free(a_block)) return;
+	_levels[0][a_block / WORD_BITS] &= ~(std::uint64_t(1) << (a_block % WORD_BITS));
+	update(a_block);
+
+	// split the run holding the block around it
+	auto run = --_runsByStart.upper_bound(a_block);
+	int start = run->first;
+	int end = run->first + run->second;
+	remove_run(start, end - start);
+	if (start < a_block) add_run(start, a_block - start);
+	if (a_block + 1 < end) add_run(a_block + 1, end - a_block - 1);
+}
+
+// Marks the block as free. Does nothing if it is free already.
+void FreeMap::mark_free(int a_block)
+{
+	if (is_free(a_block)) return;
+	_levels[0][a_block / WORD_BITS] |= std::uint64_t(1) << (a_block % WORD_BITS);
+	update(a_block);
+
+	// join the runs ending right before and starting right after the block
+	int start = a_block;
+	int end = a_block + 1;
+	auto after = _runsByStart.find(end);
+	if (after != _runsByStart.end()) {
+		end += after->second;
+		remove_run(after->first, after->second);
+	}
+	auto before = _runsByStart.lower_bound(a_block);
+	if (before != _runsByStart.begin()) {
+		--before;
+		if (before->first + before->second == a_block) {
+			start = before->first;
+			remove_run(before->first, before->second);
+		}
+	}
+	add_run(start, end - start);
+}
+
+// Returns the first set bit of the level at or after a_from, or -1. Words
+// with no set bit are skipped by asking the level above for the next one.
+int FreeMap::next_set(std::size_t a_level, int a_from) const
+{
+	const std::vector<std::uint64_t> &words = _levels[a_level];
+	std::size_t word = a_from / WORD_BITS;
+	if (word >= words.size()) return -1;
+
+	std::uint64_t bits = words[word] & (~std::uint64_t(0) << (a_from % WORD_BITS));
+	if (bits != 0) return static_cast<int>(word * WORD_BITS) + lowest_bit(bits);
+	if (a_level + 1 == _levels.size()) return -1;
+
+	int next = next_set(a_level + 1, static_cast<int>(word) + 1);
+	if (next < 0) return -1;
+	return next * WORD_BITS + lowest_bit(words[next]);
+}
+
+// Brings the summary bits above the block's word up to date.
+void FreeMap::update(int a_block)
+{
+	std::size_t index = a_block / WORD_BITS;
+	for (std::size_t level = 1; level < _levels.size(); level++) {
+		std::uint64_t mask = std::uint64_t(1) << (index % WORD_BITS);
+		std::uint64_t &word = _levels[level][index / WORD_BITS];
+		bool wasSet = (word & mask) != 0;
+		bool isSet = _levels[level - 1][index] != 0;
+		if (wasSet == isSet) break;
+		if (isSet) word |= mask;
+		else word &= ~mask;
+		index /= WORD_BITS;
+	}
+}
+
+// Indexes a run of free blocks.
+void FreeMap::add_run(int a_start, int a_length)
+{
+	_runsByStart[a_start] = a_length;
+	_runsByLength.insert(std::make_pair(a_length, a_start));
+	_runsByGroup[a_start / _groupBlocks].insert(std::make_pair(a_length, a_start));
+}
+
+// Drops a run of free blocks from the index.
+void FreeMap::remove_run(int a_start, int a_length)
+{
+	_runsByStart.erase(a_start);
+	_runsByLength.erase(std::make_pair(a_length, a_start));
+	_runsByGroup[a_start / _groupBlocks].erase(std::make_pair(a_length, a_start));
+}
+
+// Returns the first block of the shortest run of at least a_count free
+// blocks that starts in both the group and [a_from, a_end), the lowest if
+// several are as short, or -1 if there is none. Runs are visited shortest
+// first, so the first one starting in the range is the answer.
+int FreeMap::group_run(int a_group, int a_count, int a_from, int a_end) const
+{
+	const std::set<std::pair<int, int>> &runs = _runsByGroup[a_group];
+	for (auto run = runs.lower_bound(std::make_pair(a_count, -1)); run != runs.end(); ++run) {
+		if (run->second >= a_from && run->second < a_end) return run->second;
+	}
+	return -1;
+}
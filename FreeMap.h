@@ -0,0 +1,90 @@
+// CPSC 3500: Free Map
+// Keeps an in-memory copy of the free block bitmap with summary levels
+// above it, and an index of its runs of free blocks, so free blocks and
+// runs are found without scanning the bitmap.
+
+#ifndef FREE_MAP_H
+#define FREE_MAP_H
+
+#include <cstddef>  // size_t
+#include <cstdint>  // uint64_t
+#include <map>  // map
+#include <set>  // set
+#include <utility>  // pair
+#include <vector>  // vector
+
+class FreeMap
+{
+public:
+	FreeMap();
+
+	// Rebuilds the map from a superblock bitmap of a_numBlocks bits, where a
+	// set bit marks a used block. Runs are also indexed by the group of
+	// a_groupBlocks blocks they start in.
+	void load(const unsigned char *a_bitmap, int a_numBlocks, int a_groupBlocks);
+
+	// Returns the lowest free block, or -1 if every block is used.
+	int find_free() const;
+
+	// Returns the lowest free block in [a_from, a_end), or -1 if there is none.
+	int find_free(int a_from, int a_end) const;
+
+	// Returns the number of free blocks in [a_from, a_end).
+	int count_free(int a_from, int a_end) const;
+
+	// Returns the first block of the shortest run of at least a_count free
+	// blocks, the lowest such run if several are as short, or -1 if no run
+	// is long enough.
+	int find_run(int a_count) const;
+
+	// Like find_run, but only considers runs that start in [a_from, a_end),
+	// counting a run that covers a_from as starting there. A range covering
+	// whole groups is looked up in their length indexes in logarithmic time;
+	// a group only partly in the range may have to skip its runs that start
+	// outside it, so the worst case is linear in the runs of that group.
+	int find_run(int a_count, int a_from, int a_end) const;
+
+	// Returns the first block of the lowest run of at least a_count free
+	// blocks that starts in [a_from, a_end), counting a run that covers
+	// a_from as starting there, or -1 if there is none.
+	int find_first_run(int a_count, int a_from, int a_end) const;
+
+	// Returns the length of the longest run of free blocks.
+	int largest_run() const;
+
+	// Returns the number of separate runs of free blocks.
+	int run_count() const;
+
+	// Returns true if the block is free.
+	bool is_free(int a_block) const;
+
+	// Marks the block as used. Does nothing if it is used already.
+	void mark_used(int a_block);
+
+	// Marks the block as free. Does nothing if it is free already.
+	void mark_free(int a_block);
+
+private:
+	int next_set(std::size_t a_level, int a_from) const;	// returns the first set bit of the level at or after a_from, or -1
+	void update(int a_block);	// brings the summary bits above the block's word up to date
+	void add_run(int a_start, int a_length);	// indexes a run of free blocks
+	void remove_run(int a_start, int a_length);	// drops a run of free blocks from the index
+	int group_run(int a_group, int a_count, int a_from, int a_end) const;	// returns the shortest long enough run of the group starting in the range, or -1
+
+
+	// _levels[0] has a set bit for every free block. Each level above has a
+	// set bit for every word below it with a set bit, up to a single word.
+	std::vector<std::vector<std::uint64_t>> _levels;
+	int _numBlocks;
+
+	// every maximal run of free blocks, as start -> length and as
+	// (length, start) for best-fit lookups
+	std::map<int, int> _runsByStart;
+	std::set<std::pair<int, int>> _runsByLength;
+
+	// the same (length, start) index split by the group each run starts in
+	int _groupBlocks;
+	std::vector<std::set<std::pair<int, int>>> _runsByGroup;
+};
+
+#endif
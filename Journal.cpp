@@ -0,0 +1,260 @@
+// CPSC 3500: Journal
+// Holds the blocks written by an open transaction in memory, and logs them
+// to a journal file on commit, so they reach the disk all together or not
+// at all.
+
+#include <cstdint>  // intmax_t
+#include <cstdlib>  // exit
+#include <cstring>  // memcpy, memset
+#include <iostream>  // cerr, cout, endl
+#include <vector>  // vector
+
+#include <fcntl.h>  // open, O_RDWR, O_CREAT
+
+#include "Journal.h"
+#include "Blocks.h"
+#include "Disk.h"
+
+
+#if _WIN32
+#include <io.h>  // _open, _close, _lseeki64, _read, _write, _commit
+
+
+namespace
+{
+	using ssize_t = std::intmax_t;
+
+
+	int open(const char* a_fileName, int a_flags, int a_mode)
+	{
+		return _open(a_fileName, a_flags | _O_BINARY, a_mode);
+	}
+
+
+	int close(int a_fd)
+	{
+		return _close(a_fd);
+	}
+
+
+	ssize_t pread(int a_fd, void* a_buf, std::size_t a_count, std::intmax_t a_offset)
+	{
+		if (_lseeki64(a_fd, a_offset, SEEK_SET) != a_offset) {
+			return -1;
+		}
+		return _read(a_fd, a_buf, static_cast<unsigned int>(a_count));
+	}
+
+
+	ssize_t pwrite(int a_fd, const void* a_buf, std::size_t a_count, std::intmax_t a_offset)
+	{
+		if (_lseeki64(a_fd, a_offset, SEEK_SET) != a_offset) {
+			return -1;
+		}
+		return _write(a_fd, a_buf, static_cast<unsigned int>(a_count));
+	}
+
+
+	int fsync(int a_fd)
+	{
+		return _commit(a_fd);
+	}
+}
+#else
+#include <unistd.h>  // close, pread, pwrite, fsync
+#endif
+
+
+namespace
+{
+	// Marks a journal file header
+	const unsigned int JOURNAL_MAGIC_NUM = 0x4C4E524A;
+
+	// Start of the journal file. The logged blocks follow it.
+	struct JournalHeader
+	{
+		unsigned int magic;	// must be JOURNAL_MAGIC_NUM
+		unsigned int count;	// number of logged blocks, 0 if the journal is empty
+		unsigned int checksum;	// checksum of the logged blocks
+	};
+
+	// One logged block
+	struct JournalRecord
+	{
+		int block_num;
+		datablock_t block;
+	};
+
+
+	// Returns the 32-bit FNV-1a hash of the bytes, so a log torn by a crash
+	// is not mistaken for a complete one.
+	unsigned int checksum(const char* a_bytes, std::size_t a_count)
+	{
+		unsigned int hash = 2166136261u;
+		for (std::size_t i = 0; i < a_count; ++i) {
+			hash ^= static_cast<unsigned char>(a_bytes[i]);
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+}
+
+
+Journal::Journal() :
+	_fd(-1),
+	_active(false),
+	_blocks()
+{}
+
+
+Journal::~Journal()
+{
+	if (_fd >= 0) {
+		close(_fd);
+	}
+}
+
+
+// Opens the journal file, creating it if it does not exist. Unless the
+// disk was just created, a complete transaction left in the file by a
+// crash is written to the disk first.
+void Journal::mount(const char *file_name, Disk *disk, bool new_disk)
+{
+	_fd = open(file_name, O_RDWR | O_CREAT, 0644);
+	if (_fd < 0) {
+		std::cerr << "Could not open journal" << std::endl;
+		exit(-1);
+	}
+	_active = false;
+	_blocks.clear();
+
+	JournalHeader header;
+	if (new_disk || pread(_fd, &header, sizeof(header), 0) != sizeof(header) ||
+		header.magic != JOURNAL_MAGIC_NUM || header.count == 0) {
+		write_header(0, 0);
+		return;
+	}
+
+	// replay the logged blocks if all of them made it to the file
+	std::vector<JournalRecord> records(header.count);
+	ssize_t size = sizeof(JournalRecord) * records.size();
+	if (pread(_fd, records.data(), size, sizeof(header)) == size &&
+		checksum(reinterpret_cast<const char *>(records.data()), size) == header.checksum) {
+		std::vector<BlockWrite> writes;
+		for (const JournalRecord &record : records) {
+			writes.push_back(BlockWrite{ record.block_num, &record.block });
+		}
+		disk->write_blocks(writes);
+		disk->sync();
+		std::cout << "Journal: replayed " << writes.size() << " blocks" << std::endl;
+	} else {
+		std::cerr << "Journal: dropped an incomplete transaction" << std::endl;
+	}
+	write_header(0, 0);
+}
+
+
+// Drops any open transaction and closes the journal file.
+void Journal::unmount()
+{
+	abort();
+	close(_fd);
+	_fd = -1;
+}
+
+
+// Starts holding written blocks in memory.
+void Journal::begin()
+{
+	_active = true;
+	_blocks.clear();
+}
+
+
+// Returns true if a transaction is open.
+bool Journal::active() const
+{
+	return _active;
+}
+
+
+// Records block as the new contents of block block_num in the open
+// transaction.
+void Journal::write_block(int block_num, const void *block)
+{
+	std::memcpy(&_blocks[block_num], block, BLOCK_SIZE);
+}
+
+
+// Copies the open transaction's contents of block block_num into block.
+// Returns false if the transaction has not written the block.
+bool Journal::read_block(int block_num, void *block) const
+{
+	auto it = _blocks.find(block_num);
+	if (it == _blocks.end()) {
+		return false;
+	}
+	std::memcpy(block, &it->second, BLOCK_SIZE);
+	return true;
+}
+
+
+// Returns the blocks written by the open transaction, by block number.
+const std::map<int, datablock_t> &Journal::blocks() const
+{
+	return _blocks;
+}
+
+
+// Writes the open transaction's blocks to the journal file and waits
+// until they are stored. Once this returns, the transaction survives a
+// crash.
+void Journal::log()
+{
+	std::vector<JournalRecord> records(_blocks.size());
+	std::size_t i = 0;
+	for (auto &block : _blocks) {
+		records[i].block_num = block.first;
+		records[i].block = block.second;
+		i++;
+	}
+
+	// the blocks go out before the header that makes them count
+	ssize_t size = sizeof(JournalRecord) * records.size();
+	if (pwrite(_fd, records.data(), size, sizeof(JournalHeader)) != size || fsync(_fd) != 0) {
+		std::cerr << "Could not write journal" << std::endl;
+		exit(-1);
+	}
+	write_header(records.size(), checksum(reinterpret_cast<const char *>(records.data()), size));
+}
+
+
+// Empties the journal file once the logged blocks are stored on the
+// disk, and closes the transaction.
+void Journal::clear()
+{
+	write_header(0, 0);
+	abort();
+}
+
+
+// Drops the open transaction's blocks without writing them anywhere.
+void Journal::abort()
+{
+	_active = false;
+	_blocks.clear();
+}
+
+
+void Journal::write_header(unsigned int a_count, unsigned int a_checksum)
+{
+	JournalHeader header;
+	std::memset(&header, 0, sizeof(header));
+	header.magic = JOURNAL_MAGIC_NUM;
+	header.count = a_count;
+	header.checksum = a_checksum;
+	if (pwrite(_fd, &header, sizeof(header), 0) != sizeof(header) || fsync(_fd) != 0) {
+		std::cerr << "Could not write journal" << std::endl;
+		exit(-1);
+	}
+}
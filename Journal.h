@@ -0,0 +1,66 @@
+// CPSC 3500: Journal
+// Holds the blocks written by an open transaction in memory, and logs them
+// to a journal file on commit, so they reach the disk all together or not
+// at all.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <map>  // map
+
+#include "Blocks.h"
+#include "Disk.h"
+
+class Journal
+{
+public:
+	Journal();
+	~Journal();
+
+	// Opens the journal file, creating it if it does not exist. Unless the
+	// disk was just created, a complete transaction left in the file by a
+	// crash is written to the disk first.
+	void mount(const char *file_name, Disk *disk, bool new_disk);
+
+	// Drops any open transaction and closes the journal file.
+	void unmount();
+
+	// Starts holding written blocks in memory.
+	void begin();
+
+	// Returns true if a transaction is open.
+	bool active() const;
+
+	// Records block as the new contents of block block_num in the open
+	// transaction.
+	void write_block(int block_num, const void *block);
+
+	// Copies the open transaction's contents of block block_num into block.
+	// Returns false if the transaction has not written the block.
+	bool read_block(int block_num, void *block) const;
+
+	// Returns the blocks written by the open transaction, by block number.
+	const std::map<int, datablock_t> &blocks() const;
+
+	// Writes the open transaction's blocks to the journal file and waits
+	// until they are stored. Once this returns, the transaction survives a
+	// crash.
+	void log();
+
+	// Empties the journal file once the logged blocks are stored on the
+	// disk, and closes the transaction.
+	void clear();
+
+	// Drops the open transaction's blocks without writing them anywhere.
+	void abort();
+
+private:
+	void write_header(unsigned int a_count, unsigned int a_checksum);	// writes the header at the start of the file and syncs it
+
+
+	int _fd;
+	bool _active;	// true between begin and clear or abort
+	std::map<int, datablock_t> _blocks;	// blocks written by the open transaction
+};
+
+#endif
@@ -9,6 +9,7 @@
 #include <cstring>  // strerror, memset
 #include <fstream>  // ifstream
 #include <iostream>  // cerr, endl, cout, cin
+#include <limits>  // numeric_limits
 #include <sstream>  // stringstream
 #include <stdexcept>  // out_of_range
 #include <string>  // string, getline, to_string, stoi
@@ -65,15 +66,24 @@ namespace
 	{
 		kOK = 0,
 		kFileNotDir = 500,	// cd, rmdir
-		kFileIsDir,	// cat, head, append, rm
+		kFileIsDir,	// cat, head, append, appendrec, prealloc, rm, append-if, write-if, cat-if-changed
 		kFileExists,	// create, mkdir
-		kFileNotExists,	// cd, rmdir, cat, head, append, rm, stat
+		kFileNotExists,	// cd, rmdir, cat, head, append, appendrec, prealloc, rm, stat, append-if, write-if, cat-if-changed
 		kFileNameTooLong,	// create, mkdir
-		kDiskFull,	// create, mkdir, append
+		kDiskFull,	// create, mkdir, append, appendrec, prealloc, append-if, write-if
 		kDirFull,	// create, mkdir
 		kDirNotEmpty,	// rmdir
-		kAppendExceedsMaxSize,	// append
-		kCommandNotFound
+		kAppendExceedsMaxSize,	// append, appendrec, prealloc, append-if, write-if
+		kCommandNotFound,
+		kInTransaction,	// begin
+		kNotInTransaction,	// commit, abort
+		kTransactionFailed,	// commit
+		kGenerationMismatch,	// append-if, write-if
+		kNotModified,	// cat-if-changed
+			kReadOnly,	// mkdir, rmdir, create, append, appendrec, write, prealloc, rm, append-if, write-if, begin, commit, abort
+		kVolumeNotFound,	// volume
+		kVolumeBusy,	// volume
+			kBadRequest	// any command whose arguments cannot be parsed
 	};
 
 
@@ -86,10 +96,15 @@ void Shell::mountNFS(std::string a_fsLoc)
 {
 	std::string server;
 	std::string port;
+	std::string volume;
 	try {
 		std::string::size_type pos = a_fsLoc.find_first_of(':');
+		std::string::size_type slash = a_fsLoc.find_first_of('/', pos);
 		server = a_fsLoc.substr(0, pos);
-		port = a_fsLoc.substr(pos + 1);
+		port = a_fsLoc.substr(pos + 1, slash == std::string::npos ? std::string::npos : slash - pos - 1);
+		if (slash != std::string::npos) {
+			volume = a_fsLoc.substr(slash + 1);
+		}
 	} catch (std::out_of_range& e) {
 		std::cerr << e.what() << std::endl;
 		return;
@@ -131,6 +146,11 @@ void Shell::mountNFS(std::string a_fsLoc)
 		freeaddrinfo(result);
 	}
 
+	// the volume is picked before any command runs on the server's default one
+	if (_isMounted && !volume.empty() && !volume_rpc(volume)) {
+		unmountNFS();
+	}
+
 	if (!_isMounted) {
 #if _WIN32
 		WSACleanup();
@@ -153,10 +173,18 @@ void Shell::unmountNFS()
 }
 
 
+// Remote procedure call on volume
+bool Shell::volume_rpc(std::string a_volume)
+{
+	std::string msg = "volume " + a_volume + "\r\n";
+	return SendMessageAndHandleResponse(msg);
+}
+
+
 // Remote procedure call on mkdir
 void Shell::mkdir_rpc(std::string a_dirName)
 {
-	std::string msg = "mkdir " + a_dirName + "\r\n";
+	std::string msg = "mkdir " + a_dirName + "\r\n" + DurabilityHeader();
 	SendMessageAndHandleResponse(msg);
 }
 
@@ -180,7 +208,7 @@ void Shell::home_rpc()
 // Remote procedure call on rmdir
 void Shell::rmdir_rpc(std::string a_dirName)
 {
-	std::string msg = "rmdir " + a_dirName + "\r\n";
+	std::string msg = "rmdir " + a_dirName + "\r\n" + DurabilityHeader();
 	SendMessageAndHandleResponse(msg);
 }
 
@@ -195,7 +223,7 @@ void Shell::ls_rpc()
 // Remote procedure call on create
 void Shell::create_rpc(std::string a_fileNname)
 {
-	std::string msg = "create " + a_fileNname + "\r\n";
+	std::string msg = "create " + a_fileNname + "\r\n" + DurabilityHeader();
 	SendMessageAndHandleResponse(msg);
 }
 
@@ -203,7 +231,31 @@ void Shell::create_rpc(std::string a_fileNname)
 // Remote procedure call on append
 void Shell::append_rpc(std::string a_fileNname, std::string a_data)
 {
-	std::string msg = "append " + a_fileNname + " " + a_data + "\r\n";
+	std::string msg = "append " + a_fileNname + " " + a_data + "\r\n" + DurabilityHeader();
+	SendMessageAndHandleResponse(msg);
+}
+
+
+// Remote procedure call on appendrec
+void Shell::appendrec_rpc(std::string a_fileNname, std::string a_data)
+{
+	std::string msg = "appendrec " + a_fileNname + " " + a_data + "\r\n" + DurabilityHeader();
+	SendMessageAndHandleResponse(msg);
+}
+
+
+// Remote procedure call on write
+void Shell::write_rpc(std::string a_fileNname, int a_offset, std::string a_data)
+{
+	std::string msg = "write " + a_fileNname + " " + std::to_string(a_offset) + " " + a_data + "\r\n" + DurabilityHeader();
+	SendMessageAndHandleResponse(msg);
+}
+
+
+// Remote procedure call on prealloc
+void Shell::prealloc_rpc(std::string a_fileNname, int a_size)
+{
+	std::string msg = "prealloc " + a_fileNname + " " + std::to_string(a_size) + "\r\n" + DurabilityHeader();
 	SendMessageAndHandleResponse(msg);
 }
 
@@ -224,10 +276,26 @@ void Shell::head_rpc(std::string a_fileNname, int a_size)
 }
 
 
+// Remote procedure call on read
+void Shell::read_rpc(std::string a_fileNname, int a_offset, int a_size)
+{
+	std::string msg = "read " + a_fileNname + " " + std::to_string(a_offset) + " " + std::to_string(a_size) + "\r\n";
+	SendMessageAndHandleResponse(msg);
+}
+
+
+// Remote procedure call on readrec
+void Shell::readrec_rpc(std::string a_fileNname, unsigned long a_from, unsigned long a_count)
+{
+	std::string msg = "readrec " + a_fileNname + " " + std::to_string(a_from) + " " + std::to_string(a_count) + "\r\n";
+	SendMessageAndHandleResponse(msg);
+}
+
+
 // Remote procedure call on rm
 void Shell::rm_rpc(std::string a_fileNname)
 {
-	std::string msg = "rm " + a_fileNname + "\r\n";
+	std::string msg = "rm " + a_fileNname + "\r\n" + DurabilityHeader();
 	SendMessageAndHandleResponse(msg);
 }
 
@@ -240,6 +308,62 @@ void Shell::stat_rpc(std::string a_fileNname)
 }
 
 
+// Remote procedure call on stats
+void Shell::stats_rpc()
+{
+	std::string msg = "stats\r\n";
+	SendMessageAndHandleResponse(msg);
+}
+
+
+// Remote procedure call on append-if
+void Shell::append_if_rpc(std::string a_fileNname, unsigned long a_generation, std::string a_data)
+{
+	std::string msg = "append-if " + a_fileNname + " " + std::to_string(a_generation) + " " + a_data + "\r\n" + DurabilityHeader();
+	SendMessageAndHandleResponse(msg);
+}
+
+
+// Remote procedure call on write-if
+void Shell::write_if_rpc(std::string a_fileNname, unsigned long a_generation, int a_offset, std::string a_data)
+{
+	std::string msg = "write-if " + a_fileNname + " " + std::to_string(a_generation) + " " + std::to_string(a_offset) + " " + a_data + "\r\n" + DurabilityHeader();
+	SendMessageAndHandleResponse(msg);
+}
+
+
+// Remote procedure call on cat-if-changed
+void Shell::cat_if_changed_rpc(std::string a_fileNname, unsigned long a_generation)
+{
+	std::string msg = "cat-if-changed " + a_fileNname + " " + std::to_string(a_generation) + "\r\n";
+	SendMessageAndHandleResponse(msg);
+}
+
+
+// Remote procedure call on begin
+void Shell::begin_rpc()
+{
+	std::string msg = "begin\r\n";
+	SendMessageAndHandleResponse(msg);
+}
+
+
+// Remote procedure call on commit
+void Shell::commit_rpc()
+{
+	std::string msg = "commit\r\n" + DurabilityHeader();
+	SendMessageAndHandleResponse(msg);
+}
+
+
+// Remote procedure call on abort
+void Shell::abort_rpc()
+{
+	std::string msg = "abort\r\n";
+	SendMessageAndHandleResponse(msg);
+}
+
+
 // Executes the shell until the user quits.
 void Shell::run()
 {
@@ -318,6 +442,28 @@ bool Shell::execute_command(std::string command_str)
 		create_rpc(command.file_name);
 	} else if (command.name == "append") {
 		append_rpc(command.file_name, command.append_data);
+	} else if (command.name == "appendrec") {
+		appendrec_rpc(command.file_name, command.append_data);
+	} else if (command.name == "write") {
+		errno = 0;
+		unsigned long offset = strtoul(command.offset.c_str(), NULL, 0);
+		if (0 == errno) {
+			write_rpc(command.file_name, offset, command.append_data);
+		} else {
+			std::cerr << "Invalid command line: " << command.offset;
+			std::cerr << " is not a valid byte offset" << std::endl;
+			return false;
+		}
+	} else if (command.name == "prealloc") {
+		errno = 0;
+		unsigned long n = strtoul(command.append_data.c_str(), NULL, 0);
+		if (0 == errno) {
+			prealloc_rpc(command.file_name, n);
+		} else {
+			std::cerr << "Invalid command line: " << command.append_data;
+			std::cerr << " is not a valid number of bytes" << std::endl;
+			return false;
+		}
 	} else if (command.name == "cat") {
 		cat_rpc(command.file_name);
 	} else if (command.name == "head") {
@@ -330,10 +476,78 @@ bool Shell::execute_command(std::string command_str)
 			std::cerr << " is not a valid number of bytes" << std::endl;
 			return false;
 		}
+	} else if (command.name == "read") {
+		errno = 0;
+		unsigned long offset = strtoul(command.offset.c_str(), NULL, 0);
+		unsigned long n = strtoul(command.append_data.c_str(), NULL, 0);
+		if (0 == errno) {
+			read_rpc(command.file_name, offset, n);
+		} else {
+			std::cerr << "Invalid command line: " << command.offset << " " << command.append_data;
+			std::cerr << " is not a valid byte range" << std::endl;
+			return false;
+		}
+	} else if (command.name == "readrec") {
+		errno = 0;
+		unsigned long from = strtoul(command.offset.c_str(), NULL, 0);
+		unsigned long n = strtoul(command.append_data.c_str(), NULL, 0);
+		if (0 == errno) {
+			readrec_rpc(command.file_name, from, n);
+		} else {
+			std::cerr << "Invalid command line: " << command.offset << " " << command.append_data;
+			std::cerr << " is not a valid record range" << std::endl;
+			return false;
+		}
 	} else if (command.name == "rm") {
 		rm_rpc(command.file_name);
 	} else if (command.name == "stat") {
 		stat_rpc(command.file_name);
+	} else if (command.name == "stats") {
+		stats_rpc();
+	} else if (command.name == "append-if") {
+		errno = 0;
+		unsigned long generation = strtoul(command.generation.c_str(), NULL, 0);
+		if (0 == errno && generation <= std::numeric_limits<unsigned int>::max()) {
+			append_if_rpc(command.file_name, generation, command.append_data);
+		} else {
+			std::cerr << "Invalid command line: " << command.generation;
+			std::cerr << " is not a valid generation" << std::endl;
+			return false;
+		}
+	} else if (command.name == "write-if") {
+		errno = 0;
+		unsigned long generation = strtoul(command.generation.c_str(), NULL, 0);
+		unsigned long offset = strtoul(command.offset.c_str(), NULL, 0);
+		if (0 == errno && generation <= std::numeric_limits<unsigned int>::max()) {
+			write_if_rpc(command.file_name, generation, offset, command.append_data);
+		} else {
+			std::cerr << "Invalid command line: " << command.generation << " " << command.offset;
+			std::cerr << " is not a valid generation and byte offset" << std::endl;
+			return false;
+		}
+	} else if (command.name == "cat-if-changed") {
+		errno = 0;
+		unsigned long generation = strtoul(command.generation.c_str(), NULL, 0);
+		if (0 == errno && generation <= std::numeric_limits<unsigned int>::max()) {
+			cat_if_changed_rpc(command.file_name, generation);
+		} else {
+			std::cerr << "Invalid command line: " << command.generation;
+			std::cerr << " is not a valid generation" << std::endl;
+			return false;
+		}
+	} else if (command.name == "begin") {
+		begin_rpc();
+	} else if (command.name == "commit") {
+		commit_rpc();
+	} else if (command.name == "abort") {
+		abort_rpc();
+	} else if (command.name == "durability") {
+		if (command.file_name == "none" || command.file_name == "flush" || command.file_name == "fsync") {
+			_durability = command.file_name;
+		} else {
+			std::cerr << "Invalid command line: " << command.file_name;
+			std::cerr << " is not a durability level (none, flush or fsync)" << std::endl;
+		}
 	} else if (command.name == "quit") {
 		return true;
 	}
@@ -347,7 +561,7 @@ bool Shell::execute_command(std::string command_str)
 Shell::Command Shell::parse_command(std::string command_str)
 {
 	// empty command struct returned for errors
-	struct Command empty = { "", "", "" };
+	struct Command empty = { "", "", "", "", "" };
 
 	// grab each of the tokens (if they exist)
 	struct Command command;
@@ -357,11 +571,28 @@ Shell::Command Shell::parse_command(std::string command_str)
 		num_tokens++;
 		if (ss >> command.file_name) {
 			num_tokens++;
-			if (ss >> command.append_data) {
+
+			// conditional commands take the generation right after the file name
+			bool conditional = command.name == "append-if" || command.name == "write-if" || command.name == "cat-if-changed";
+			if (conditional && ss >> command.generation) {
+				num_tokens++;
+			}
+			if ((!conditional || num_tokens == 3) && ss >> command.append_data) {
 				num_tokens++;
-				std::string junk;
-				if (ss >> junk) {
+				std::string data;
+				if (ss >> data) {
 					num_tokens++;
+					std::string junk;
+					if (ss >> junk) {
+						num_tokens++;
+					}
+				}
+
+				// the offset comes before the data (write) or byte count (read), and
+				// the first record before the record count (readrec)
+				if (command.name == "write" || command.name == "read" || command.name == "readrec" || command.name == "write-if") {
+					command.offset = command.append_data;
+					command.append_data = data;
 				}
 			}
 		}
@@ -375,6 +606,10 @@ Shell::Command Shell::parse_command(std::string command_str)
 	// Check for invalid command lines
 	if (command.name == "ls" ||
 		command.name == "home" ||
+		command.name == "stats" ||
+		command.name == "begin" ||
+		command.name == "commit" ||
+		command.name == "abort" ||
 		command.name == "quit") {
 		if (num_tokens != 1) {
 			std::cerr << "Invalid command line: " << command.name;
@@ -387,18 +622,32 @@ Shell::Command Shell::parse_command(std::string command_str)
 		command.name == "create" ||
 		command.name == "cat" ||
 		command.name == "rm" ||
-		command.name == "stat") {
+		command.name == "stat" ||
+		command.name == "durability") {
 		if (num_tokens != 2) {
 			std::cerr << "Invalid command line: " << command.name;
 			std::cerr << " has improper number of arguments" << std::endl;
 			return empty;
 		}
-	} else if (command.name == "append" || command.name == "head") {
+	} else if (command.name == "append" || command.name == "appendrec" || command.name == "head" || command.name == "prealloc" ||
+		command.name == "cat-if-changed") {
 		if (num_tokens != 3) {
 			std::cerr << "Invalid command line: " << command.name;
 			std::cerr << " has improper number of arguments" << std::endl;
 			return empty;
 		}
+	} else if (command.name == "write" || command.name == "read" || command.name == "readrec" || command.name == "append-if") {
+		if (num_tokens != 4) {
+			std::cerr << "Invalid command line: " << command.name;
+			std::cerr << " has improper number of arguments" << std::endl;
+			return empty;
+		}
+	} else if (command.name == "write-if") {
+		if (num_tokens != 5) {
+			std::cerr << "Invalid command line: " << command.name;
+			std::cerr << " has improper number of arguments" << std::endl;
+			return empty;
+		}
 	} else {
 		std::cerr << "Invalid command line: " << command.name;
 		std::cerr << " is not a command" << std::endl;
@@ -409,11 +658,19 @@ Shell::Command Shell::parse_command(std::string command_str)
 }
 
 
-void Shell::SendMessageAndHandleResponse(const std::string& a_message)
+std::string Shell::DurabilityHeader() const
+{
+	return _durability.empty() ? "" : "Durability: " + _durability + "\r\n";
+}
+
+
+bool Shell::SendMessageAndHandleResponse(const std::string& a_message)
 {
-	if (!SendMessage(a_message) || !HandleResponse()) {
+	bool ok = false;
+	if (!SendMessage(a_message) || !HandleResponse(ok)) {
 		unmountNFS();
 	}
+	return ok;
 }
 
 
@@ -433,7 +690,7 @@ bool Shell::SendMessage(const std::string& a_message)
 }
 
 
-bool Shell::HandleResponse()
+bool Shell::HandleResponse(bool& a_ok)
 {
 	static char buf[8000];
 	std::size_t pos = 0;
@@ -456,12 +713,12 @@ bool Shell::HandleResponse()
 		}
 	}
 
-	PrintResponse(buf, msgSize);
+	a_ok = PrintResponse(buf, msgSize);
 	return true;
 }
 
 
-void Shell::PrintResponse(const char* buf, ssize_t a_bufLen)
+bool Shell::PrintResponse(const char* buf, ssize_t a_bufLen)
 {
 	try {
 		std::string msg(buf, a_bufLen);
@@ -503,6 +760,33 @@ void Shell::PrintResponse(const char* buf, ssize_t a_bufLen)
 		case FileError::kCommandNotFound:
 			std::cerr << "Command not found!" << std::endl;
 			break;
+		case FileError::kInTransaction:
+			std::cerr << "A transaction is already open!" << std::endl;
+			break;
+		case FileError::kNotInTransaction:
+			std::cerr << "No transaction is open!" << std::endl;
+			break;
+		case FileError::kTransactionFailed:
+			std::cerr << "Transaction failed and was rolled back!" << std::endl;
+			break;
+		case FileError::kGenerationMismatch:
+			std::cerr << "File has changed, its generation is now:" << std::endl;
+			break;
+		case FileError::kNotModified:
+			std::cerr << "File has not changed!" << std::endl;
+			break;
+		case FileError::kReadOnly:
+			std::cerr << "File system is read-only!" << std::endl;
+			break;
+		case FileError::kVolumeNotFound:
+			std::cerr << "Volume does not exist!" << std::endl;
+			break;
+		case FileError::kVolumeBusy:
+			std::cerr << "Volume is mounted by another client!" << std::endl;
+			break;
+		case FileError::kBadRequest:
+			std::cerr << "Server could not parse the command!" << std::endl;
+			break;
 		default:
 			break;
 		}
@@ -513,7 +797,9 @@ void Shell::PrintResponse(const char* buf, ssize_t a_bufLen)
 			std::cout << extraMsg;
 		}
 		std::cout << dendl;
+		return statusCode == FileError::kOK;
 	} catch (std::exception& e) {
 		std::cerr << e.what() << std::endl;
+		return false;
 	}
 }
@@ -50,7 +50,7 @@ public:
 	{}
 
 	// Mount a network file system located in host:port, set is_mounted = true if success
-	void mountNFS(std::string fs_loc);  //fs_loc must be in the format of server:port
+	void mountNFS(std::string fs_loc);  //fs_loc must be in the format of server:port, or server:port/volume to pick one of the server's volumes
 
 	//unmount the mounted network file syste,
 	void unmountNFS();
@@ -68,12 +68,15 @@ private:
 	{
 		std::string name;	// name of command
 		std::string file_name;	// name of file
-		std::string append_data;	// append data (append only)
+		std::string append_data;	// append data (append, appendrec, write, append-if, write-if only)
+		std::string offset;	// byte offset (write, read, write-if only)
+		std::string generation;	// expected file generation (append-if, write-if, cat-if-changed only)
 	};
 
 
 	bool execute_command(std::string command_str);	// Executes the command. Returns true for quit and false otherwise.
 	Command parse_command(std::string command_str);	// Parses a command line into a command struct. Returned name is blank for invalid command lines.
+	bool volume_rpc(std::string volume);	// Remote procedure call on volume, returns true if the volume was mounted
 	void mkdir_rpc(std::string dname);	// Remote procedure call on mkdir
 	void cd_rpc(std::string dname);	// Remote procedure call on cd
 	void home_rpc();	// Remote procedure call on home
@@ -81,20 +84,34 @@ private:
 	void ls_rpc();	// Remote procedure call on ls
 	void create_rpc(std::string fname);	// Remote procedure call on create
 	void append_rpc(std::string fname, std::string data);	// Remote procedure call on append
+	void appendrec_rpc(std::string fname, std::string data);	// Remote procedure call on appendrec
+	void write_rpc(std::string fname, int offset, std::string data);	// Remote procedure call on write
+	void prealloc_rpc(std::string fname, int n);	// Remote procedure call on prealloc
 	void cat_rpc(std::string fname);	// Remote procesure call on cat
 	void head_rpc(std::string fname, int n);	// Remote procedure call on head
+	void read_rpc(std::string fname, int offset, int n);	// Remote procedure call on read
+	void readrec_rpc(std::string fname, unsigned long from, unsigned long n);	// Remote procedure call on readrec
 	void rm_rpc(std::string fname);	// Remote procedure call on rm
 	void stat_rpc(std::string fname);	// Remote procedure call on stat
-
-	void SendMessageAndHandleResponse(const std::string& a_message);	// runs SendMessage and HandleResponse
+	void stats_rpc();	// Remote procedure call on stats
+	void append_if_rpc(std::string fname, unsigned long generation, std::string data);	// Remote procedure call on append-if
+	void write_if_rpc(std::string fname, unsigned long generation, int offset, std::string data);	// Remote procedure call on write-if
+	void cat_if_changed_rpc(std::string fname, unsigned long generation);	// Remote procedure call on cat-if-changed
+	void begin_rpc();	// Remote procedure call on begin
+	void commit_rpc();	// Remote procedure call on commit
+	void abort_rpc();	// Remote procedure call on abort
+
+	std::string DurabilityHeader() const;	// header carrying the durability level of mutating requests
+	bool SendMessageAndHandleResponse(const std::string& a_message);	// runs SendMessage and HandleResponse, returns true if the command succeeded
 	bool SendMessage(const std::string& a_message);	// sends a message to socket connection
-	bool HandleResponse();	// handles response from socket connection
-	void PrintResponse(const char* buf, ssize_t a_bufLen);	// prints response recieved from socket connection
+	bool HandleResponse(bool& a_ok);	// handles response from socket connection, a_ok is set if the command succeeded
+	bool PrintResponse(const char* buf, ssize_t a_bufLen);	// prints response recieved from socket connection, returns true if it reports success
 
 
 	// members
 	socket_t _csSock; // socket to the network file system server
 	bool _isMounted; // true if the network file system is mounted, false otherise
+	std::string _durability; // durability level of mutating requests, empty for the server default
 };
 
 #endif
@@ -21,8 +21,8 @@ int main(int argc, char **argv)
 	} else {
 		std::cerr << "Invalid command line" << std::endl;
 		std::cerr << "Usage (one of the following): " << std::endl;
-		std::cerr << "./nfsclient server:port" << std::endl;
-		std::cerr << "./nfsclient -s <script-name> server:port" << std::endl;
+		std::cerr << "./nfsclient server:port[/volume]" << std::endl;
+		std::cerr << "./nfsclient -s <script-name> server:port[/volume]" << std::endl;
 	}
 
 	return 0;
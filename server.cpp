@@ -1,12 +1,20 @@
+#include <algorithm>  // find_if, max, min
 #include <cerrno>  // errno
-#include <cstdlib>  // atoi
+#include <csignal>  // signal, SIGPIPE, SIG_IGN
+#include <cstdlib>  // atoi, free, realpath
 #include <cstring>  // memset, strerror
+#include <exception>  // exception
 #include <functional>  // function
 #include <iostream>  // cout, cerr
+#include <limits>  // numeric_limits
+#include <list>  // list
+#include <memory>  // unique_ptr
+#include <stdexcept>  // out_of_range
 #include <string>  // string, stoi
 #include <type_traits>  // underlying_type
 #include <unordered_map>  // unordered_map
-#include <utility>  // make_pair
+#include <utility>  // make_pair, pair
+#include <vector>  // vector
 
 #include "FileSys.h"
 
@@ -41,7 +49,9 @@ namespace
 }
 #else
 #include <sys/types.h>
+#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -73,6 +83,21 @@ namespace
 #endif
 		return a_os;
 	}
+
+
+	// Requests a client may run in one turn on a volume given no share
+	const std::size_t DEFAULT_SHARE = 16;
+
+
+	// parses a file generation, rejecting any the iNode could not hold
+	unsigned int ParseGeneration(const std::string& a_str)
+	{
+		unsigned long generation = std::stoul(a_str);
+		if (generation > std::numeric_limits<decltype(inode_t::generation)>::max()) {
+			throw std::out_of_range("generation " + a_str + " is out of range");
+		}
+		return static_cast<unsigned int>(generation);
+	}
 }
 
 
@@ -83,9 +108,9 @@ public:
 
 
 	// takes ownership of the passed socket
-	explicit CommandParser(socket_t a_sock)
+	CommandParser(socket_t a_sock, const MountOptions& a_options)
 	{
-		_fs.mount(a_sock);
+		_fs.mount(a_sock, a_options);
 
 		_commandTable.insert(std::make_pair("mkdir", [this](const std::string& a_msg) -> void
 		{
@@ -134,6 +159,35 @@ public:
 			_fs.append(fileName.c_str(), data.c_str());
 		}));
 
+		_commandTable.insert(std::make_pair("appendrec", [this](const std::string& a_msg) -> void
+		{
+			std::string::size_type pos1 = a_msg.find_first_of(' ') + 1;
+			std::string::size_type pos2 = a_msg.find_first_of(' ', pos1);
+			std::string fileName(a_msg, pos1, pos2++ - pos1);
+			std::string data(a_msg, pos2, a_msg.find_first_of('\r', pos2) - pos2);
+			_fs.appendrec(fileName.c_str(), data.c_str());
+		}));
+
+		_commandTable.insert(std::make_pair("write", [this](const std::string& a_msg) -> void
+		{
+			std::string::size_type pos1 = a_msg.find_first_of(' ') + 1;
+			std::string::size_type pos2 = a_msg.find_first_of(' ', pos1);
+			std::string::size_type pos3 = a_msg.find_first_of(' ', pos2 + 1);
+			std::string fileName(a_msg, pos1, pos2++ - pos1);
+			std::string offset(a_msg, pos2, pos3++ - pos2);
+			std::string data(a_msg, pos3, a_msg.find_first_of('\r', pos3) - pos3);
+			_fs.write(fileName.c_str(), std::stoi(offset), data.c_str());
+		}));
+
+		_commandTable.insert(std::make_pair("prealloc", [this](const std::string& a_msg) -> void
+		{
+			std::string::size_type pos1 = a_msg.find_first_of(' ') + 1;
+			std::string::size_type pos2 = a_msg.find_first_of(' ', pos1);
+			std::string fileName(a_msg, pos1, pos2++ - pos1);
+			std::string size(a_msg, pos2, a_msg.find_first_of('\r', pos2) - pos2);
+			_fs.prealloc(fileName.c_str(), std::stoi(size));
+		}));
+
 		_commandTable.insert(std::make_pair("stat", [this](const std::string& a_msg) -> void
 		{
 			std::string::size_type pos = a_msg.find_first_of(' ') + 1;
@@ -157,12 +211,86 @@ public:
 			_fs.head(fileName.c_str(), std::stoi(size));
 		}));
 
+		_commandTable.insert(std::make_pair("read", [this](const std::string& a_msg) -> void
+		{
+			std::string::size_type pos1 = a_msg.find_first_of(' ') + 1;
+			std::string::size_type pos2 = a_msg.find_first_of(' ', pos1);
+			std::string::size_type pos3 = a_msg.find_first_of(' ', pos2 + 1);
+			std::string fileName(a_msg, pos1, pos2++ - pos1);
+			std::string offset(a_msg, pos2, pos3++ - pos2);
+			std::string size(a_msg, pos3, a_msg.find_first_of('\r', pos3) - pos3);
+			_fs.read(fileName.c_str(), std::stoi(offset), std::stoi(size));
+		}));
+		_commandTable.insert(std::make_pair("readrec", [this](const std::string& a_msg) -> void
+		{
+			std::string::size_type pos1 = a_msg.find_first_of(' ') + 1;
+			std::string::size_type pos2 = a_msg.find_first_of(' ', pos1);
+			std::string::size_type pos3 = a_msg.find_first_of(' ', pos2 + 1);
+			std::string fileName(a_msg, pos1, pos2++ - pos1);
+			std::string from(a_msg, pos2, pos3++ - pos2);
+			std::string count(a_msg, pos3, a_msg.find_first_of('\r', pos3) - pos3);
+			_fs.readrec(fileName.c_str(), std::stoul(from), std::stoul(count));
+		}));
+
+		_commandTable.insert(std::make_pair("stats", [this](const std::string& a_msg) -> void
+		{
+			_fs.stats();
+		}));
+
 		_commandTable.insert(std::make_pair("rm", [this](const std::string& a_msg) -> void
 		{
 			std::string::size_type pos = a_msg.find_first_of(' ') + 1;
 			std::string fileName(a_msg, pos, a_msg.find_first_of('\r') - pos);
 			_fs.rm(fileName.c_str());
 		}));
+
+		_commandTable.insert(std::make_pair("append-if", [this](const std::string& a_msg) -> void
+		{
+			std::string::size_type pos1 = a_msg.find_first_of(' ') + 1;
+			std::string::size_type pos2 = a_msg.find_first_of(' ', pos1);
+			std::string::size_type pos3 = a_msg.find_first_of(' ', pos2 + 1);
+			std::string fileName(a_msg, pos1, pos2++ - pos1);
+			std::string generation(a_msg, pos2, pos3++ - pos2);
+			std::string data(a_msg, pos3, a_msg.find_first_of('\r', pos3) - pos3);
+			_fs.appendIf(fileName.c_str(), ParseGeneration(generation), data.c_str());
+		}));
+
+		_commandTable.insert(std::make_pair("write-if", [this](const std::string& a_msg) -> void
+		{
+			std::string::size_type pos1 = a_msg.find_first_of(' ') + 1;
+			std::string::size_type pos2 = a_msg.find_first_of(' ', pos1);
+			std::string::size_type pos3 = a_msg.find_first_of(' ', pos2 + 1);
+			std::string::size_type pos4 = a_msg.find_first_of(' ', pos3 + 1);
+			std::string fileName(a_msg, pos1, pos2++ - pos1);
+			std::string generation(a_msg, pos2, pos3++ - pos2);
+			std::string offset(a_msg, pos3, pos4++ - pos3);
+			std::string data(a_msg, pos4, a_msg.find_first_of('\r', pos4) - pos4);
+			_fs.writeIf(fileName.c_str(), ParseGeneration(generation), std::stoi(offset), data.c_str());
+		}));
+
+		_commandTable.insert(std::make_pair("cat-if-changed", [this](const std::string& a_msg) -> void
+		{
+			std::string::size_type pos1 = a_msg.find_first_of(' ') + 1;
+			std::string::size_type pos2 = a_msg.find_first_of(' ', pos1);
+			std::string fileName(a_msg, pos1, pos2++ - pos1);
+			std::string generation(a_msg, pos2, a_msg.find_first_of('\r', pos2) - pos2);
+			_fs.catIfChanged(fileName.c_str(), ParseGeneration(generation));
+		}));
+
+		_commandTable.insert(std::make_pair("begin", [this](const std::string& a_msg) -> void
+		{
+			_fs.beginTransaction();
+		}));
+
+		_commandTable.insert(std::make_pair("commit", [this](const std::string& a_msg) -> void
+		{
+			_fs.commitTransaction();
+		}));
+
+		_commandTable.insert(std::make_pair("abort", [this](const std::string& a_msg) -> void
+		{
+			_fs.abortTransaction();
+		}));
 	}
 
 
@@ -187,6 +315,27 @@ public:
 	}
 
 
+	// makes the changes so far at least as durable as the given level
+	void commit(Durability a_level)
+	{
+		_fs.commit(a_level);
+	}
+
+
+	// warms the block cache a little, returns true while there is more to do
+	bool prefetch()
+	{
+		return _fs.prefetch();
+	}
+
+
+	// frees some blocks of removed files, returns true while there is more to do
+	bool reclaim()
+	{
+		return _fs.reclaim();
+	}
+
+
 	// retrieves the last error from the filesystem
 	FileError getLastErr() const noexcept
 	{
@@ -194,6 +343,13 @@ public:
 	}
 
 
+	// retrieves the error of the last delayed data that failed to flush
+	FileError getFlushErr() noexcept
+	{
+		return _fs.getFlushErr();
+	}
+
+
 	~CommandParser()
 	{
 		_fs.unmount();
@@ -209,51 +365,99 @@ private:
 };
 
 
-struct Response
+// Splits the byte stream from a socket connection into null-terminated messages
+class MessageReader
 {
 public:
-	Response() = default;
-	explicit Response(const std::string& a_msg, bool a_good) :
-		msg(a_msg),
-		good(a_good)
+	MessageReader() = delete;
+
+
+	explicit MessageReader(socket_t a_sock) :
+		_sock(a_sock),
+		_buf()
 	{}
 
 
-	explicit operator bool()
+	// takes up to a_max messages that have already arrived, reading the
+	// socket first if bytes are waiting; returns false once the client has
+	// disconnected and every message it sent has been taken
+	bool poll(std::vector<std::string>& a_msgs, std::size_t a_max)
 	{
-		return good;
+		a_msgs.clear();
+		bool open = !Ready() || Fill();
+		Split(a_msgs, a_max);
+		return open || !a_msgs.empty();
 	}
 
 
-	std::string msg;	// msg recieved from response
-	bool good;	// true == no errors while getting response
-};
+	// returns true if a whole message is waiting in the buffer
+	bool buffered() const
+	{
+		return _buf.find('\0') != std::string::npos;
+	}
+
+private:
+	// returns true if the socket can be read without blocking
+	bool Ready() const
+	{
+		fd_set readSet;
+		FD_ZERO(&readSet);
+		FD_SET(_sock, &readSet);
+		timeval timeout = { 0, 0 };
+		return select(static_cast<int>(_sock) + 1, &readSet, 0, 0, &timeout) > 0;
+	}
 
 
-// Handles response message from socket connection
-Response HandleResponse(socket_t a_sock)
-{
-	static char buf[8000];
-	std::size_t pos = 0;
-	ssize_t msgSize = 0;
-	ssize_t result = 1;
-	while (result != 0) {
-		result = read(a_sock, buf + msgSize, sizeof(buf) - msgSize);
+	// reads more bytes from the socket, returns false on error or disconnect
+	bool Fill()
+	{
+		static char buf[8000];
+		ssize_t result = read(_sock, buf, sizeof(buf));
 		if (result == -1) {
 			std::cerr << "Read failed with error \"" << std::strerror(errno) << "\"" << std::endl;
-			return Response("", false);
-		} else {
-			msgSize += result;
-			while (pos < msgSize) {
-				if (buf[pos] == '\0') {
-					result = 0;
-					break;
-				}
-				++pos;
-			}
+			return false;
+		} else if (result == 0) {	// client disconnected
+			return false;
+		}
+		_buf.append(buf, result);
+		return true;
+	}
+
+
+	// moves up to a_max complete messages out of the buffer
+	void Split(std::vector<std::string>& a_msgs, std::size_t a_max)
+	{
+		std::string::size_type pos;
+		while (a_msgs.size() < a_max && (pos = _buf.find('\0')) != std::string::npos) {
+			a_msgs.push_back(_buf.substr(0, pos));
+			_buf.erase(0, pos + 1);
 		}
 	}
-	return Response(std::string(buf, msgSize), true);
+
+
+	socket_t _sock;
+	std::string _buf;	// bytes of messages that have not been taken yet
+};
+
+
+// Returns the durability level requested by the message's "Durability" header
+Durability ParseDurability(const std::string& a_msg)
+{
+	static const std::string header("\r\nDurability: ");
+	std::string::size_type pos = a_msg.find(header);
+	if (pos == std::string::npos) {
+		return Durability::kFlushed;
+	}
+
+	pos += header.length();
+	std::string level(a_msg, pos, a_msg.find_first_of('\r', pos) - pos);
+	if (level == "none") {
+		return Durability::kNone;
+	} else if (level == "fsync") {
+		return Durability::kSynced;
+	} else {
+		return Durability::kFlushed;
+	}
 }
 
 
@@ -295,6 +499,33 @@ std::string PrepareMessage(FileError a_lastErr, std::string a_extraMessage)
 	case FileError::kCommandNotFound:
 		header1 += " COMMAND_NOT_FOUND";
 		break;
+	case FileError::kInTransaction:
+		header1 += " IN_TRANSACTION";
+		break;
+	case FileError::kNotInTransaction:
+		header1 += " NOT_IN_TRANSACTION";
+		break;
+	case FileError::kTransactionFailed:
+		header1 += " TRANSACTION_FAILED";
+		break;
+	case FileError::kGenerationMismatch:
+		header1 += " GENERATION_MISMATCH";
+		break;
+	case FileError::kNotModified:
+		header1 += " NOT_MODIFIED";
+		break;
+	case FileError::kReadOnly:
+		header1 += " READ_ONLY";
+		break;
+	case FileError::kVolumeNotFound:
+		header1 += " VOLUME_NOT_FOUND";
+		break;
+	case FileError::kVolumeBusy:
+		header1 += " VOLUME_BUSY";
+		break;
+	case FileError::kBadRequest:
+		header1 += " BAD_REQUEST";
+		break;
 	case FileError::kOK:
 	default:
 		header1 += " OK";
@@ -323,15 +554,275 @@ bool DispatchMessage(socket_t a_sock, const std::string& a_msg)
 }
 
 
+// A disk image the server can mount for its clients
+struct Volume
+{
+	std::string name;	// name of the disk file, clients pick the volume by it
+	MountOptions options;	// how the volume is mounted, with its own cache budget
+	std::size_t share;	// requests of a client run in one turn, so a busy volume cannot starve the others
+	bool mounted;	// true while a client has the volume mounted
+};
+
+
+// A client connection and the volume it has mounted
+struct Session
+{
+	socket_t sock;
+	MessageReader reader;
+	std::unique_ptr<CommandParser> parser;	// null until the client's volume is mounted
+	Volume* volume;
+};
+
+
+// Mounts the volume the session's first request names with "volume", or the
+// first volume if it names none. Returns the error to reply with if the
+// volume does not exist or another client has it mounted.
+FileError MountVolume(Session& a_session, std::vector<Volume>& a_volumes, const std::string& a_request)
+{
+	std::string key(a_request, 0, a_request.find_first_of(" \r"));
+	Volume* volume = &a_volumes.front();
+	if (key == "volume") {
+		std::string::size_type pos = a_request.find_first_of(' ') + 1;
+		std::string name(a_request, pos, a_request.find_first_of('\r', pos) - pos);
+		auto it = std::find_if(a_volumes.begin(), a_volumes.end(), [&](const Volume& a_volume) { return a_volume.name == name; });
+		if (it == a_volumes.end()) {
+			return FileError::kVolumeNotFound;
+		}
+		volume = &*it;
+	}
+	if (volume->mounted) {
+		return FileError::kVolumeBusy;
+	}
+
+	std::cout << "Mounting volume " << volume->name << dendl;
+	a_session.parser.reset(new CommandParser(a_session.sock, volume->options));
+	a_session.volume = volume;
+	volume->mounted = true;
+	return FileError::kOK;
+}
+
+
+// Runs the session's next turn of requests. Returns false once the session
+// is over.
+bool ServeSession(Session& a_session, std::vector<Volume>& a_volumes)
+{
+	std::vector<std::string> requests;
+	if (!a_session.reader.poll(requests, a_session.volume ? a_session.volume->share : 1)) {
+		return false;
+	}
+	if (requests.empty()) {
+		return true;
+	}
+
+	// the first request mounts a volume, and is done if it only picked one
+	if (!a_session.parser) {
+		FileError err = MountVolume(a_session, a_volumes, requests.front());
+		if (err != FileError::kOK) {
+			DispatchMessage(a_session.sock, PrepareMessage(err, ""));
+			return false;
+		}
+		if (requests.front().compare(0, 7, "volume ") == 0) {
+			return DispatchMessage(a_session.sock, PrepareMessage(FileError::kOK, ""));
+		}
+	}
+	CommandParser& parser = *a_session.parser;
+
+	// run the whole batch, then commit it at the level of its most demanding
+	// request before replying, so that a single sync covers all of them
+	std::vector<std::pair<FileError, std::string>> results;
+	Durability durability = Durability::kNone;
+	for (auto& request : requests) {
+		try {
+			if (!parser(request)) {
+				results.emplace_back(FileError::kCommandNotFound, "");
+			} else {
+				results.emplace_back(parser.getLastErr(), parser.getQueryResponse());
+				durability = std::max(durability, ParseDurability(request));
+			}
+		} catch (std::exception& e) {	// a malformed request fails on its own, the server and its other clients go on
+			std::cerr << "Bad request \"" << request.substr(0, request.find_first_of('\r')) << "\": " << e.what() << std::endl;
+			parser.getLastErr();
+			parser.getQueryResponse();
+			results.emplace_back(FileError::kBadRequest, "");
+		}
+	}
+	parser.commit(durability);
+
+	// delayed data that failed to reach the disk while the batch ran or
+	// committed cannot be pinned on one request, so none of them is told OK
+	FileError flushErr = parser.getFlushErr();
+	for (auto& result : results) {
+		if (flushErr != FileError::kOK && result.first == FileError::kOK) {
+			result = std::make_pair(flushErr, std::string());
+		}
+		if (!DispatchMessage(a_session.sock, PrepareMessage(result.first, result.second))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// Unmounts the session's volume and closes its connection
+void CloseSession(Session& a_session)
+{
+	if (a_session.parser) {
+		a_session.parser.reset();	// closes the socket
+		a_session.volume->mounted = false;
+		std::cout << "Unmounted volume " << a_session.volume->name << dendl;
+	} else {
+		close(a_session.sock);
+	}
+}
+
+
+// Sets the mount flags in a volume spec's comma separated flag list. Returns
+// false if one of them is not a mount flag.
+bool ParseVolumeFlags(const std::string& a_flags, MountOptions& a_options)
+{
+	std::string::size_type pos = 0;
+	while (pos < a_flags.length()) {
+		std::string::size_type end = std::min(a_flags.find_first_of(',', pos), a_flags.length());
+		std::string flag(a_flags, pos, end - pos);
+		if (flag == "read-only") {
+			a_options.read_only = true;
+		} else if (flag == "direct-io") {
+			a_options.direct_io = true;
+		} else if (flag == "next-fit") {
+			a_options.next_fit = true;
+		} else if (flag == "deferred-free") {
+			a_options.deferred_free = true;
+		} else {
+			return false;
+		}
+		pos = end + 1;
+	}
+	return true;
+}
+
+
+// Returns the name of the disk file with its directory resolved, so that
+// two names for one file compare equal even before the file exists
+std::string CanonicalDiskFile(const std::string& a_name)
+{
+#if _WIN32
+	return a_name;
+#else
+	std::string::size_type slash = a_name.find_last_of('/');
+	std::string dir = slash == std::string::npos ? "." : a_name.substr(0, slash + 1);
+	char* resolved = realpath(dir.c_str(), nullptr);
+	if (!resolved) {
+		return a_name;
+	}
+	std::string path = std::string(resolved) + '/' + a_name.substr(slash == std::string::npos ? 0 : slash + 1);
+	std::free(resolved);
+
+	// a disk file that is a link is known by the file it points to
+	struct stat info;
+	if (lstat(path.c_str(), &info) == 0 && S_ISLNK(info.st_mode)) {
+		resolved = realpath(path.c_str(), nullptr);
+		if (resolved) {
+			path = resolved;
+			std::free(resolved);
+		}
+	}
+	return path;
+#endif
+}
+
+
 int main(int argc, char* argv[])
 {
+	const char usage[] = "Usage: ./nfsserver port# [--no-huge-pages] [--cache-min blocks] [--cache-max blocks] [--direct-io] [--next-fit] [--deferred-free] [--read-only] [--volume name[:cache-blocks[:share]][,flag]...]...\n"
+		"The --direct-io, --next-fit, --deferred-free and --read-only flags apply to every volume; a volume's own flags (direct-io, next-fit, deferred-free, read-only) apply to it alone.\n";
 	unsigned short port;
-	if (argc != 2) {
-		std::cout << "Usage: ./nfsserver port#\n";
+	MountOptions options;
+	std::vector<Volume> volumes;
+	if (argc < 2) {
+		std::cout << usage;
 		return -1;
 	} else {
 		port = std::atoi(argv[1]);
 	}
+	for (int i = 2; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--no-huge-pages") == 0) {
+			options.huge_pages = false;
+		} else if (std::strcmp(argv[i], "--cache-min") == 0 && i + 1 < argc) {
+			options.cache_min_blocks = std::atoi(argv[++i]);
+		} else if (std::strcmp(argv[i], "--cache-max") == 0 && i + 1 < argc) {
+			options.cache_max_blocks = std::atoi(argv[++i]);
+		} else if (std::strcmp(argv[i], "--direct-io") == 0) {
+			options.direct_io = true;
+		} else if (std::strcmp(argv[i], "--next-fit") == 0) {
+			options.next_fit = true;
+		} else if (std::strcmp(argv[i], "--deferred-free") == 0) {
+			options.deferred_free = true;
+		} else if (std::strcmp(argv[i], "--read-only") == 0) {
+			options.read_only = true;
+		} else if (std::strcmp(argv[i], "--volume") == 0 && i + 1 < argc) {
+			// name, then optionally the most blocks its cache may hold and its
+			// share, then any mount flags of its own
+			std::string spec(argv[++i]);
+			std::string::size_type flags = std::min(spec.find_first_of(','), spec.length());
+			std::string::size_type pos = spec.find_first_of(':');
+			Volume volume = { spec.substr(0, std::min(pos, flags)), MountOptions(), 0, false };
+			if (flags < spec.length() && !ParseVolumeFlags(spec.substr(flags + 1), volume.options)) {
+				std::cout << usage;
+				return -1;
+			}
+			spec.erase(flags);
+			pos = spec.find_first_of(':');
+			volume.options.cache_max_blocks = 0;
+			if (pos != std::string::npos) {
+				volume.options.cache_max_blocks = std::atoi(spec.c_str() + pos + 1);
+				pos = spec.find_first_of(':', pos + 1);
+				if (volume.options.cache_max_blocks <= 0) {
+					std::cout << usage;
+					return -1;
+				}
+			}
+			if (pos != std::string::npos) {
+				volume.share = std::atoi(spec.c_str() + pos + 1);
+			}
+			if (volume.name.empty()) {
+				std::cout << usage;
+				return -1;
+			}
+			for (auto& other : volumes) {
+				if (CanonicalDiskFile(volume.name) == CanonicalDiskFile(other.name)) {
+					std::cerr << "Volumes " << other.name << " and " << volume.name << " would share one disk file!" << std::endl;
+					return -1;
+				}
+			}
+			volumes.push_back(volume);
+		} else {
+			std::cout << usage;
+			return -1;
+		}
+	}
+
+	// every volume is mounted with the server-wide options and its own flags
+	// on top, and its cache stays within its own budget, if it was given one
+	if (volumes.empty()) {
+		volumes.push_back(Volume{ options.disk_file, options, 0, false });
+	}
+	for (auto& volume : volumes) {
+		MountOptions own = volume.options;
+		volume.options = options;
+		volume.options.disk_file = volume.name;
+		volume.options.direct_io |= own.direct_io;
+		volume.options.next_fit |= own.next_fit;
+		volume.options.deferred_free |= own.deferred_free;
+		volume.options.read_only |= own.read_only;
+		if (own.cache_max_blocks > 0) {
+			volume.options.cache_max_blocks = own.cache_max_blocks;
+		}
+		volume.options.cache_min_blocks = std::min(options.cache_min_blocks, volume.options.cache_max_blocks);
+		volume.options.cache_blocks = std::min(options.cache_blocks, volume.options.cache_max_blocks);
+		if (volume.share == 0) {
+			volume.share = DEFAULT_SHARE;
+		}
+	}
 
 #if _WIN32
 	WSADATA wsaData;
@@ -340,6 +831,8 @@ int main(int argc, char* argv[])
 		std::cerr << "WSAStartup failed with error \"" << std::strerror(errno) << "\"" << std::endl;
 		return -1;
 	}
+#else
+	std::signal(SIGPIPE, SIG_IGN);	// a client that goes away must not take the other clients down
 #endif
 
 	sockaddr_in serverAddr;
@@ -369,7 +862,7 @@ int main(int argc, char* argv[])
 	}
 
 	// listen
-	if (listen(listenSock, 0) != 0) {
+	if (listen(listenSock, SOMAXCONN) != 0) {
 		std::cerr << "Socket listen failed with error \"" << std::strerror(errno) << "\"" << std::endl;
 		close(listenSock);
 #if _WIN32
@@ -380,32 +873,71 @@ int main(int argc, char* argv[])
 		std::cout << "Waiting for connection..." << dendl;
 	}
 
-	// accept
-	socket_t acceptSock = accept(listenSock, 0, 0);
-	if (acceptSock == INVALID_SOCKET) {
-		std::cerr << "Socket accept failed with error \"" << std::strerror(errno) << "\"" << std::endl;
-		close(listenSock);
-#if _WIN32
-		WSACleanup();
-#endif
-		return -1;
-	} else {
-		std::cout << "Client connected" << dendl;
-	}
-
 	// communication
-	CommandParser parser(acceptSock);
-	Response response;
-	while (response = HandleResponse(acceptSock)) {
-		std::string msg;
-		if (!parser(response.msg)) {
-			msg = PrepareMessage(FileError::kCommandNotFound, "");
-		} else {
-			msg = PrepareMessage(parser.getLastErr(), parser.getQueryResponse());
+	std::list<Session> sessions;
+	bool background = true;	// false once no volume has background work left
+	while (true) {
+		// wait for a client to connect or send something, unless a message is
+		// already waiting or background work is left
+		fd_set readSet;
+		FD_ZERO(&readSet);
+		FD_SET(listenSock, &readSet);
+		socket_t maxSock = listenSock;
+		bool waiting = false;
+		for (auto& session : sessions) {
+			FD_SET(session.sock, &readSet);
+			maxSock = std::max(maxSock, session.sock);
+			waiting = waiting || session.reader.buffered();
 		}
-		if (!DispatchMessage(acceptSock, msg)) {
+		timeval now = { 0, 0 };
+		if (select(static_cast<int>(maxSock) + 1, &readSet, 0, 0, waiting || background ? &now : 0) < 0) {
+			std::cerr << "Select failed with error \"" << std::strerror(errno) << "\"" << std::endl;
 			break;
 		}
+
+		// accept
+		if (FD_ISSET(listenSock, &readSet)) {
+			socket_t acceptSock = accept(listenSock, 0, 0);
+			if (acceptSock == INVALID_SOCKET) {
+				std::cerr << "Socket accept failed with error \"" << std::strerror(errno) << "\"" << std::endl;
+			} else {
+				std::cout << "Client connected" << dendl;
+				sessions.push_back(Session{ acceptSock, MessageReader(acceptSock), nullptr, nullptr });
+			}
+		}
+
+		// give every client with requests one turn, in order
+		bool served = false;
+		for (auto it = sessions.begin(); it != sessions.end();) {
+			if (!FD_ISSET(it->sock, &readSet) && !it->reader.buffered()) {
+				++it;
+				continue;
+			}
+			served = true;
+			if (ServeSession(*it, volumes)) {
+				++it;
+			} else {
+				CloseSession(*it);
+				it = sessions.erase(it);
+			}
+		}
+
+		// free the blocks of removed files and read the warm-up lists in while
+		// the clients have nothing for us
+		if (served) {
+			background = true;
+		} else {
+			background = false;
+			for (auto& session : sessions) {
+				if (session.parser && (session.parser->reclaim() || session.parser->prefetch())) {
+					background = true;
+				}
+			}
+		}
+	}
+
+	for (auto& session : sessions) {
+		CloseSession(session);
 	}
 
 	// cleanup